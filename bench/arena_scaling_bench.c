@@ -0,0 +1,100 @@
+/**
+ * Scaling benchmark for multi-threaded sf_malloc/sf_free.
+ *
+ * Each thread churns a small window of small blocks.  Every thread count from
+ * 1 to N is run first with the single shared main arena and then again after
+ * sf_set_arenas(N), so the two columns show what per-thread arenas buy.  The
+ * online CPU count is printed first: with fewer CPUs than threads the threads
+ * take turns, and the columns compare locking overheads rather than scaling.
+ *
+ * usage: arena_scaling_bench [max threads] [ops per thread]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define WINDOW    8
+#define MAX_SIZE  256
+
+static long ops_per_thread = 200000;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *churn(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    void *live[WINDOW] = { NULL };
+
+    for (long i = 0; i < ops_per_thread; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 16) % WINDOW;
+        if (live[slot] != NULL) {
+            sf_free(live[slot]);
+        }
+        live[slot] = sf_malloc(1 + (seed >> 8) % MAX_SIZE);
+        if (live[slot] == NULL) {
+            fprintf(stderr, "sf_malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int slot = 0; slot < WINDOW; slot++) {
+        if (live[slot] != NULL) {
+            sf_free(live[slot]);
+        }
+    }
+    return NULL;
+}
+
+static double run(int nthreads) {
+    pthread_t threads[MAX_ARENAS];
+    double start = now();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, churn, (void *)(size_t)(i + 1));
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    return (double)nthreads * ops_per_thread / elapsed;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+    if (argc > 2) {
+        ops_per_thread = atol(argv[2]);
+    }
+    if (max_threads < 1 || max_threads > MAX_ARENAS) {
+        fprintf(stderr, "max threads must be between 1 and %d\n", MAX_ARENAS);
+        return EXIT_FAILURE;
+    }
+
+    double shared[MAX_ARENAS + 1];
+    for (int t = 1; t <= max_threads; t++) {
+        shared[t] = run(t);
+    }
+
+    sf_set_arenas(max_threads);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%ld online CPUs%s\n", cpus, cpus < max_threads ? "; runs with more threads than CPUs do not show scaling" : "");
+    printf("%-8s %16s %16s %10s\n", "threads", "1 arena ops/s", "N arenas ops/s", "scaling");
+    double base = 0;
+    for (int t = 1; t <= max_threads; t++) {
+        double per_thread = run(t);
+        if (t == 1) {
+            base = per_thread;
+        }
+        printf("%-8d %16.0f %16.0f %9.2fx\n", t, shared[t], per_thread, per_thread / base);
+    }
+    return EXIT_SUCCESS;
+}
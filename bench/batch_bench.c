@@ -0,0 +1,85 @@
+/**
+ * Benchmark for the batch allocation entry points.
+ *
+ * For each batch size, allocates and frees a group of same-size objects many
+ * times, once with a loop of sf_malloc/sf_free and once with
+ * sf_malloc_batch/sf_free_batch, and reports nanoseconds per object for each.
+ * The batch is freed in allocation order, then again in a fixed shuffled order,
+ * which is what callers freeing objects that outlived each other pass.
+ *
+ * usage: batch_bench [object size] [rounds]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define MAX_BATCH  256
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char const *argv[]) {
+    size_t size = argc > 1 ? (size_t)atol(argv[1]) : 64;
+    long rounds = argc > 2 ? atol(argv[2]) : 2000;
+    void *objects[MAX_BATCH];
+    void *shuffled[MAX_BATCH];
+    int order[MAX_BATCH];
+    unsigned int seed = 1;
+
+    printf("%-8s %14s %14s %10s %16s\n", "batch", "loop ns/obj", "batch ns/obj", "speedup", "shuffled ns/obj");
+    for (int n = 16; n <= MAX_BATCH; n *= 2) {
+        double start = now();
+        for (long r = 0; r < rounds; r++) {
+            for (int i = 0; i < n; i++) {
+                objects[i] = sf_malloc(size);
+            }
+            for (int i = 0; i < n; i++) {
+                sf_free(objects[i]);
+            }
+        }
+        double loop = (now() - start) * 1e9 / (rounds * n);
+
+        start = now();
+        for (long r = 0; r < rounds; r++) {
+            if (sf_malloc_batch(size, n, objects) != (size_t)n) {
+                fprintf(stderr, "sf_malloc_batch failed\n");
+                return EXIT_FAILURE;
+            }
+            sf_free_batch(objects, n);
+        }
+        double batch = (now() - start) * 1e9 / (rounds * n);
+
+        for (int i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        for (int i = n - 1; i > 0; i--) {
+            seed = seed * 1103515245 + 12345;
+            int j = (seed >> 16) % (i + 1);
+            int swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+
+        start = now();
+        for (long r = 0; r < rounds; r++) {
+            if (sf_malloc_batch(size, n, objects) != (size_t)n) {
+                fprintf(stderr, "sf_malloc_batch failed\n");
+                return EXIT_FAILURE;
+            }
+            for (int i = 0; i < n; i++) {
+                shuffled[i] = objects[order[i]];
+            }
+            sf_free_batch(shuffled, n);
+        }
+        double random = (now() - start) * 1e9 / (rounds * n);
+
+        printf("%-8d %14.1f %14.1f %9.2fx %16.1f\n", n, loop, batch, loop / batch, random);
+    }
+    return EXIT_SUCCESS;
+}
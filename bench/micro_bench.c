@@ -0,0 +1,222 @@
+/**
+ * Microbenchmark suite.
+ *
+ * Runs one case per allocation pattern and writes a CSV row for each with the
+ * nanoseconds per operation and how much the heap grew during the case, so runs
+ * on different commits can be compared line by line.  An operation is one
+ * allocation or free, or one realloc.
+ *
+ *   fast_path     malloc and free of the same size, back to back
+ *   lifo_churn    groups of mixed small sizes, freed newest first
+ *   lifo_sized    lifo_churn, freeing with sf_free_sized to compare against sf_free
+ *   fifo_churn    the same groups, freed oldest first
+ *   random_churn  a pool of blocks of random sizes, a random one replaced each time
+ *   realloc_grow  a few buffers grown round-robin a little at a time
+ *   memalign      aligned blocks of random sizes and alignments
+ *   large         blocks of several pages; the first round grows the heap with getMemory
+ *
+ * The heap comes from sf_provider_mmap, since the large case needs more than the
+ * sf_mem_grow heap has.  make bench-csv appends a run labelled with the current
+ * commit to BENCH_CSV.
+ *
+ * usage: micro_bench [-q] [-l label] [-s scale]
+ *   -q  leave out the header row
+ *   -l  label for the first column, "-" by default
+ *   -s  multiplies the operation count of every case
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define HEAP_RESERVE  ((size_t)1 << 32)
+#define POOL_SIZE     1024
+#define GROUP_SIZE    256
+#define BUFFERS       4
+#define LARGE_BLOCKS  512
+#define LARGE_SIZE    (8 * PAGE_SZ)
+
+static void *pool[POOL_SIZE];
+static unsigned int seed = 1;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int next_random() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+static void *checked(void *pp) {
+    if (pp == NULL) {
+        fprintf(stderr, "allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return pp;
+}
+
+static long fast_path(long n) {
+    for (long i = 0; i < n; i++) {
+        sf_free(checked(sf_malloc(64)));
+    }
+    return 2 * n;
+}
+
+static long churn(long n, int lifo, int sized) {
+    long rounds = n / GROUP_SIZE;
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < GROUP_SIZE; i++) {
+            pool[i] = checked(sf_malloc(16 + (i * 24) % 240));
+        }
+        for (int i = 0; i < GROUP_SIZE; i++) {
+            int j = lifo ? GROUP_SIZE - 1 - i : i;
+            if (sized) {
+                sf_free_sized(pool[j], 16 + (j * 24) % 240);
+            } else {
+                sf_free(pool[j]);
+            }
+        }
+    }
+    return 2 * rounds * GROUP_SIZE;
+}
+
+static long lifo_churn(long n) {
+    return churn(n, 1, 0);
+}
+
+static long lifo_sized(long n) {
+    return churn(n, 1, 1);
+}
+
+static long fifo_churn(long n) {
+    return churn(n, 0, 0);
+}
+
+static long random_churn(long n) {
+    for (int i = 0; i < POOL_SIZE; i++) {
+        pool[i] = checked(sf_malloc(8 + next_random() % 4096));
+    }
+    for (long i = 0; i < n; i++) {
+        int slot = next_random() % POOL_SIZE;
+        sf_free(pool[slot]);
+        pool[slot] = checked(sf_malloc(8 + next_random() % 4096));
+    }
+    for (int i = 0; i < POOL_SIZE; i++) {
+        sf_free(pool[i]);
+    }
+    return 2 * (n + POOL_SIZE);
+}
+
+static long realloc_grow(long n) {
+    long ops = 0;
+    while (ops < n) {
+        size_t lengths[BUFFERS] = { 0 };
+        for (int i = 0; i < BUFFERS; i++) {
+            pool[i] = checked(sf_malloc(16));
+            lengths[i] = 16;
+        }
+        for (int step = 0; step < 1024; step++) {
+            for (int i = 0; i < BUFFERS; i++) {
+                lengths[i] += 1 + next_random() % 64;
+                pool[i] = checked(sf_realloc(pool[i], lengths[i]));
+            }
+        }
+        for (int i = 0; i < BUFFERS; i++) {
+            sf_free(pool[i]);
+        }
+        ops += 1024 * BUFFERS + 2 * BUFFERS;
+    }
+    return ops;
+}
+
+static long aligned(long n) {
+    long rounds = n / POOL_SIZE;
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < POOL_SIZE; i++) {
+            pool[i] = checked(sf_memalign(16 + next_random() % 512, (size_t)64 << next_random() % 7));
+        }
+        for (int i = 0; i < POOL_SIZE; i++) {
+            sf_free(pool[i]);
+        }
+    }
+    return 2 * rounds * POOL_SIZE;
+}
+
+static long large(long n) {
+    // Only the first round grows the heap; later ones reuse what it freed
+    long rounds = n / LARGE_BLOCKS > 0 ? n / LARGE_BLOCKS : 1;
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < LARGE_BLOCKS; i++) {
+            pool[i] = checked(sf_malloc(LARGE_SIZE + i % 8 * 512));
+        }
+        for (int i = 0; i < LARGE_BLOCKS; i++) {
+            sf_free(pool[i]);
+        }
+    }
+    return 2 * rounds * LARGE_BLOCKS;
+}
+
+static const struct {
+    const char *name;
+    long (*run)(long n);
+    long ops;
+} cases[] = {
+    { "fast_path", fast_path, 1000000 },
+    { "lifo_churn", lifo_churn, 500000 },
+    { "lifo_sized", lifo_sized, 500000 },
+    { "fifo_churn", fifo_churn, 500000 },
+    { "random_churn", random_churn, 500000 },
+    { "realloc_grow", realloc_grow, 200000 },
+    { "memalign", aligned, 200000 },
+    { "large", large, 512 },
+};
+
+int main(int argc, char *argv[]) {
+    const char *label = "-";
+    int header = 1;
+    long scale = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            header = 0;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            scale = atol(argv[++i]);
+        } else {
+            scale = 0;
+            break;
+        }
+    }
+    if (scale < 1) {
+        fprintf(stderr, "usage: %s [-q] [-l label] [-s scale]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sf_page_provider provider;
+    if (sf_provider_mmap(&provider, HEAP_RESERVE) != 0 || sf_set_page_provider(&provider) != 0) {
+        fprintf(stderr, "cannot set up the mmap page provider\n");
+        return EXIT_FAILURE;
+    }
+
+    if (header) {
+        printf("label,case,ops,ns_per_op,heap_growth,grow_calls,heap_size\n");
+    }
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        sf_stats_counters before, after;
+        sf_stats(&before);
+        double start = now();
+        long ops = cases[c].run(cases[c].ops * scale);
+        double elapsed = now() - start;
+        sf_stats(&after);
+
+        printf("%s,%s,%ld,%.1f,%lu,%lu,%lu\n", label, cases[c].name, ops, elapsed * 1e9 / ops,
+               after.peak_heap - before.peak_heap, after.grow_calls - before.grow_calls, after.heap_size);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+/**
+ * Append benchmark for sf_realloc.
+ *
+ * Grows a number of buffers a few bytes at a time, round-robin, the way a
+ * workload that keeps appending to buffers does, and reports how many of the
+ * reallocs grew in place and how many payload bytes that saved from being
+ * copied.  With one buffer every realloc can extend into the wilderness; with
+ * several, buffers block each other and some have to move.
+ *
+ * usage: realloc_append_bench [max buffers] [bytes per buffer]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define MAX_BUFFERS  16
+#define MAX_APPEND   64
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_buffers = argc > 1 ? atoi(argv[1]) : 4;
+    size_t target = argc > 2 ? (size_t)atol(argv[2]) : 8192;
+    if (max_buffers < 1 || max_buffers > MAX_BUFFERS) {
+        fprintf(stderr, "max buffers must be between 1 and %d\n", MAX_BUFFERS);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %10s %10s %8s %14s %14s %10s\n", "buffers", "appends", "in place", "moved",
+           "bytes copied", "bytes saved", "ns/op");
+    for (int n = 1; n <= max_buffers; n *= 2) {
+        char *buffers[MAX_BUFFERS] = { NULL };
+        size_t lengths[MAX_BUFFERS] = { 0 };
+        unsigned int seed = 1;
+        long ops = 0;
+
+        sf_realloc_counters before, after;
+        sf_realloc_stats(&before);
+        double start = now();
+        for (int done = 0; done < n; ) {
+            done = 0;
+            for (int i = 0; i < n; i++) {
+                if (lengths[i] >= target) {
+                    done++;
+                    continue;
+                }
+
+                seed = seed * 1103515245 + 12345;
+                size_t append = 1 + (seed >> 16) % MAX_APPEND;
+                char *grown = buffers[i] == NULL ? sf_malloc(append) : sf_realloc(buffers[i], lengths[i] + append);
+                if (grown == NULL) {
+                    fprintf(stderr, "out of memory with %d buffers; try fewer bytes per buffer\n", n);
+                    return EXIT_FAILURE;
+                }
+                memset(grown + lengths[i], 'a' + i, append);
+                buffers[i] = grown;
+                lengths[i] += append;
+                ops++;
+            }
+        }
+        double elapsed = now() - start;
+        sf_realloc_stats(&after);
+
+        for (int i = 0; i < n; i++) {
+            sf_free(buffers[i]);
+        }
+
+        printf("%-8d %10ld %10lu %8lu %14lu %14lu %10.1f\n", n, ops,
+               after.in_place - before.in_place, after.moved - before.moved,
+               after.bytes_copied - before.bytes_copied,
+               after.bytes_not_copied - before.bytes_not_copied, elapsed * 1e9 / ops);
+    }
+    return EXIT_SUCCESS;
+}
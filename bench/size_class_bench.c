@@ -0,0 +1,109 @@
+/**
+ * Microbenchmark for the free list size class mapping.
+ *
+ * Times the two doubling loops the allocator used to carry (getIndex and the
+ * head of checkFreeList) against the count-leading-zeros getIndex, and reports
+ * cycles per classification for each.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define NUM_SIZES   4096
+#define ITERATIONS  2000
+
+/* Original getIndex: [min, max) intervals. */
+static int oldGetIndex(size_t size) {
+    if (size <= 32) {
+        return 0;
+    }
+
+    if (size > 256 * 32) {
+        return 9;
+    }
+
+    int index = 1;
+    int min = 32;
+    int max = 2 * min;
+    while (index < NUM_FREE_LISTS - 1) {
+        if(size >= min && size < max) {
+            break;
+        }
+        min = max;
+        max = 2 * min;
+        index++;
+    }
+
+    return index;
+}
+
+/* Original head of checkFreeList: (min, max] intervals. */
+static int oldCheckFreeListIndex(size_t adjSize) {
+    int min = 0;
+    int max = 32;
+    int index = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        if (adjSize > min && adjSize <= max) {
+            index = i;
+            break;
+        }
+        min = max;
+        max = max * 2;
+    }
+    return index;
+}
+
+static unsigned long long readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double timeClassifier(const char *name, int (*classify)(size_t), size_t *sizes) {
+    volatile int sink = 0;
+    unsigned long long start = readCycles();
+    for (int i = 0; i < ITERATIONS; i++) {
+        for (int j = 0; j < NUM_SIZES; j++) {
+            sink += classify(sizes[j]);
+        }
+    }
+    unsigned long long end = readCycles();
+    double per = (double)(end - start) / ((double)ITERATIONS * NUM_SIZES);
+    printf("%-24s %8.2f cycles/classification\n", name, per);
+    return per;
+}
+
+int main(int argc, char const *argv[]) {
+    static size_t sizes[NUM_SIZES];
+
+    // Block sizes spanning every class, weighted towards small blocks like a real trace
+    srand(320);
+    for (int i = 0; i < NUM_SIZES; i++) {
+        int order = rand() % 16;
+        size_t size = (size_t)MIN_BLOCK_SIZE + (rand() % (1 << order));
+        sizes[i] = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    }
+
+    // The two loops disagree at exact powers of two, the new mapping follows the spec
+    int mismatches = 0;
+    for (int i = 0; i < NUM_SIZES; i++) {
+        if (getIndex(sizes[i]) != oldCheckFreeListIndex(sizes[i])) {
+            mismatches++;
+        }
+    }
+
+    double before = timeClassifier("getIndex (loop)", oldGetIndex, sizes);
+    timeClassifier("checkFreeList (loop)", oldCheckFreeListIndex, sizes);
+    double after = timeClassifier("getIndex (clz)", getIndex, sizes);
+
+    printf("speedup over getIndex loop: %.2fx\n", before / after);
+    printf("sizes classified differently from checkFreeList: %d of %d\n", mismatches, NUM_SIZES);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,318 @@
+/**
+ * Trace replay driver.
+ *
+ * Replays an allocation trace against the allocator, or with -g against glibc
+ * malloc, and reports throughput, latency percentiles per operation and the peak
+ * heap next to the peak of live payload bytes.  It reads the binary traces
+ * sf_trace_start records and the text traces of the CMU malloclab driver, a few
+ * of which are in bench/traces.
+ *
+ * The trace is replayed three times: once to measure the peak heap, once, with
+ * no per-operation timing, for throughput, and once timing every operation.
+ * Blocks a pass leaves allocated are freed before the next one.  The allocator
+ * gets its pages from sf_provider_mmap, since the sf_mem_grow heap is too small
+ * for most traces.  The driver's own arrays are mapped directly, so glibc's heap
+ * holds nothing but the trace's blocks and its peak compares to the allocator's.
+ *
+ * usage: trace_replay [-g] [-r repeats] trace
+ */
+#define _DEFAULT_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define HEAP_RESERVE  ((size_t)1 << 32)
+#define OP_TYPES      5
+
+typedef struct {
+    int type;
+    unsigned long id;
+    size_t size;
+    size_t align;
+} trace_op;
+
+static trace_op *ops;
+static size_t num_ops;
+static void **blocks;
+static unsigned long num_ids;
+static int use_glibc;
+
+static const char op_types[OP_TYPES] = { SF_TRACE_MALLOC, SF_TRACE_CALLOC, SF_TRACE_MEMALIGN, SF_TRACE_REALLOC, SF_TRACE_FREE };
+static const char *op_names[OP_TYPES] = { "malloc", "calloc", "memalign", "realloc", "free" };
+
+static int op_index(int type) {
+    for (int t = 0; t < OP_TYPES; t++) {
+        if (op_types[t] == type) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *map_array(size_t count, size_t size) {
+    // Zeroed array outside glibc's heap
+    void *array = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (array == MAP_FAILED) {
+        fprintf(stderr, "out of memory reading the trace\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+static void add_op(int type, unsigned long id, size_t size, size_t align) {
+    static size_t capacity = 0;
+    if (num_ops == capacity) {
+        trace_op *grown = map_array(capacity == 0 ? 4096 : capacity * 2, sizeof(*ops));
+        if (ops != NULL) {
+            memcpy(grown, ops, num_ops * sizeof(*ops));
+            munmap(ops, capacity * sizeof(*ops));
+        }
+        ops = grown;
+        capacity = capacity == 0 ? 4096 : capacity * 2;
+    }
+    ops[num_ops++] = (trace_op){ type, id, size, align };
+    if (id >= num_ids) {
+        num_ids = id + 1;
+    }
+}
+
+static int read_varint(FILE *file, size_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF) {
+            return -1;
+        }
+        *value |= (size_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int read_binary(FILE *file) {
+    if (fgetc(file) != SF_TRACE_VERSION) {
+        return -1;
+    }
+
+    int type;
+    while ((type = fgetc(file)) != EOF) {
+        size_t id, size = 0, align = 0;
+        if (read_varint(file, &id) != 0) {
+            return -1;
+        }
+        if (type != SF_TRACE_FREE && read_varint(file, &size) != 0) {
+            return -1;
+        }
+        if (type == SF_TRACE_MEMALIGN && read_varint(file, &align) != 0) {
+            return -1;
+        }
+        if (op_index(type) < 0) {
+            return -1;
+        }
+        add_op(type, id, size, align);
+    }
+    return 0;
+}
+
+static int read_malloclab(FILE *file) {
+    // Suggested heap size, number of IDs, number of operations and weight, then one operation per line
+    long header[4];
+    for (int i = 0; i < 4; i++) {
+        if (fscanf(file, "%ld", &header[i]) != 1) {
+            return -1;
+        }
+    }
+
+    char type;
+    unsigned long id;
+    size_t size = 0;
+    while (fscanf(file, " %c %lu", &type, &id) == 2) {
+        if ((type == 'a' || type == 'r') && fscanf(file, "%zu", &size) != 1) {
+            return -1;
+        }
+        if (type != 'a' && type != 'r' && type != 'f') {
+            return -1;
+        }
+        add_op(type, id, type == 'f' ? 0 : size, 0);
+    }
+    return feof(file) ? 0 : -1;
+}
+
+static void *replay_op(trace_op *op) {
+    // Returns the block the operation left for its ID, NULL after a free
+    void *block = blocks[op->id];
+    switch (op->type) {
+    case SF_TRACE_MALLOC:
+        return use_glibc ? malloc(op->size) : sf_malloc(op->size);
+    case SF_TRACE_CALLOC:
+        return use_glibc ? calloc(1, op->size) : sf_calloc(1, op->size);
+    case SF_TRACE_MEMALIGN:
+        if (use_glibc) {
+            void *aligned = NULL;
+            return posix_memalign(&aligned, op->align, op->size) == 0 ? aligned : NULL;
+        }
+        return sf_memalign(op->size, op->align);
+    case SF_TRACE_REALLOC:
+        if (use_glibc) {
+            return realloc(block, op->size);
+        }
+        return block == NULL ? sf_malloc(op->size) : sf_realloc(block, op->size);
+    default:
+        if (use_glibc) {
+            free(block);
+        } else if (block != NULL) {
+            sf_free(block);
+        }
+        return NULL;
+    }
+}
+
+static void run_op(trace_op *op) {
+    void *block = replay_op(op);
+    if (block == NULL && op->type != SF_TRACE_FREE && op->size != 0) {
+        fprintf(stderr, "%s of %zu bytes failed\n", op_names[op_index(op->type)], op->size);
+        exit(EXIT_FAILURE);
+    }
+    if (block != NULL && op->type != SF_TRACE_REALLOC) {
+        *(char *)block = 1;
+    }
+    blocks[op->id] = block;
+}
+
+static void free_all() {
+    for (unsigned long id = 0; id < num_ids; id++) {
+        if (blocks[id] != NULL) {
+            trace_op op = { SF_TRACE_FREE, id, 0, 0 };
+            run_op(&op);
+        }
+    }
+}
+
+static size_t glibc_heap() {
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    long repeats = 1;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-g") == 0) {
+            use_glibc = 1;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeats = atol(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL || repeats < 1) {
+        fprintf(stderr, "usage: %s [-g] [-r repeats] trace\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    char magic[4];
+    int binary = fread(magic, 1, 4, file) == 4 && memcmp(magic, SF_TRACE_MAGIC, 4) == 0;
+    if (!binary) {
+        rewind(file);
+    }
+    if ((binary ? read_binary(file) : read_malloclab(file)) != 0 || num_ops == 0) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+
+    blocks = map_array(num_ids, sizeof(*blocks));
+    size_t *sizes = map_array(num_ids, sizeof(*sizes));
+    double *latency = map_array(num_ops, sizeof(*latency));
+    double *sorted = map_array(num_ops, sizeof(*sorted));
+
+    if (!use_glibc) {
+        sf_page_provider provider;
+        if (sf_provider_mmap(&provider, HEAP_RESERVE) != 0 || sf_set_page_provider(&provider) != 0) {
+            fprintf(stderr, "cannot set up the mmap page provider\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Peak heap, and the peak of live payload bytes it compares to
+    size_t live = 0, peak_live = 0, peak_heap = 0;
+    for (size_t i = 0; i < num_ops; i++) {
+        run_op(&ops[i]);
+        live = live - sizes[ops[i].id] + ops[i].size;
+        sizes[ops[i].id] = ops[i].size;
+        peak_live = live > peak_live ? live : peak_live;
+        if (use_glibc) {
+            size_t heap = glibc_heap();
+            peak_heap = heap > peak_heap ? heap : peak_heap;
+        }
+    }
+    free_all();
+    if (!use_glibc) {
+        sf_stats_counters stats;
+        sf_stats(&stats);
+        peak_heap = stats.peak_heap;
+    }
+
+    double start = now();
+    for (long r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < num_ops; i++) {
+            run_op(&ops[i]);
+        }
+        free_all();
+    }
+    double elapsed = now() - start;
+
+    for (size_t i = 0; i < num_ops; i++) {
+        double op_start = now();
+        run_op(&ops[i]);
+        latency[i] = (now() - op_start) * 1e9;
+    }
+    free_all();
+
+    printf("%s: %zu ops, %lu ids, %s\n", path, num_ops, num_ids, use_glibc ? "glibc malloc" : "sf_malloc");
+    printf("%-10s %14.0f\n", "ops/sec", num_ops * repeats / elapsed);
+    printf("%-10s %14zu\n", "peak heap", peak_heap);
+    printf("%-10s %14zu\n", "peak live", peak_live);
+    printf("%-10s %13.1f%%\n", "util", peak_heap == 0 ? 0.0 : 100.0 * peak_live / peak_heap);
+
+    // Latency percentiles of each kind of operation, in nanoseconds
+    printf("\n%-10s %10s %10s %10s %10s %10s\n", "op", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (int t = 0; t < OP_TYPES; t++) {
+        size_t n = 0;
+        for (size_t i = 0; i < num_ops; i++) {
+            if (ops[i].type == op_types[t]) {
+                sorted[n++] = latency[i];
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(sorted, n, sizeof(*sorted), compare_ns);
+        printf("%-10s %10zu %10.0f %10.0f %10.0f %10.0f\n", op_names[t], n,
+               sorted[n / 2], sorted[n * 99 / 100], sorted[n * 999 / 1000], sorted[n - 1]);
+    }
+    return EXIT_SUCCESS;
+}
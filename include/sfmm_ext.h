@@ -0,0 +1,627 @@
+/**
+ * Extensions to the allocator declared in sfmm.h.
+ *
+ * sfmm.h is replaced during grading and must not be modified, so any
+ * prototypes or constants needed beyond the assignment interface live here.
+ */
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+#include <pthread.h>
+#include <stddef.h>
+
+#include "sfmm.h"
+
+#define MIN_BLOCK_SIZE  32  /* Smallest block the allocator hands out. */
+#define ALIGN_SIZE       8  /* Alignment of every block header and payload. */
+#define MIN_BLOCK_SHIFT  5  /* log2(MIN_BLOCK_SIZE), used by the size class mapping. */
+#define SMALL_FREE_SIZES  ((MIN_BLOCK_SIZE << (NUM_FREE_LISTS - 2)) / ALIGN_SIZE)  /* Sizes below the top class. */
+
+/*
+ * Size class mapping for the main free lists.
+ *
+ * List 0 holds blocks of size M (M = MIN_BLOCK_SIZE), list i holds blocks in
+ * (2^(i-1) M, 2^i M] and the last list holds everything larger than 256M.
+ * The class is ceil(log2(size / M)), computed with a single count-leading-zeros
+ * instead of a doubling loop.
+ *
+ * @param size The block size (header included), a multiple of ALIGN_SIZE.
+ * @return The index into sf_free_list_heads for a block of that size.
+ */
+int getIndex(size_t size);
+
+/*
+ * Quick list index for a block of exactly the given size.
+ *
+ * @param size The block size (header included).
+ * @return (size - MIN_BLOCK_SIZE) / ALIGN_SIZE, or -1 if no quick list holds that size.
+ */
+int getQuickIndex(size_t size);
+
+#define MAX_SUB_BINS       4             /* Most sub-bins sf_set_sub_bins accepts per size class. */
+#define MAX_ARENAS        16             /* Upper bound accepted by sf_set_arenas. */
+#define MAX_ARENA_CHUNKS  256            /* Chunks all secondary arenas may own together. */
+#define ARENA_CHUNK_SIZE  (2 * PAGE_SZ)  /* Minimum main heap block carved per arena chunk. */
+
+#define CACHE_LINE_SIZE     64  /* Alignment and size granule of sf_malloc_cacheline blocks. */
+#define CACHELINE_CLASSES    4  /* Payloads of 1 to 4 cache lines get their own bins. */
+#define CACHELINE_BIN_MAX    8  /* Blocks a cache line bin holds before it is flushed. */
+#define ALIGNED_PROBES       8  /* Free blocks sf_memalign tries in place before it over-allocates. */
+
+/*
+ * An arena is one independent set of quick lists and main free lists, guarded
+ * by its own lock.
+ *
+ * The main arena uses sf_quick_lists and sf_free_list_heads and owns the heap
+ * grown by sf_mem_grow.  Secondary arenas own chunks: allocated blocks carved
+ * from the main arena, each laid out as a small heap of its own with a
+ * prologue and epilogue so coalescing never leaves the chunk.
+ */
+typedef struct sf_arena {
+    pthread_mutex_t lock;
+
+    __typeof__(sf_quick_lists[0]) *quick_lists;
+    sf_block *free_list_heads;
+    int lists_initialized;       // -1 until the free list sentinels are set up
+
+    // Bit i is set exactly when free_list_heads[i] holds at least one block.
+    // Maintained by addToFreeList/removeFromFreeList so the first usable class
+    // is found with a single find-first-set.
+    unsigned int nonempty_free_lists;
+
+    // Epilogue of the heap (main arena) or of the newest chunk (secondary arenas).
+    sf_block *epilogue;
+
+    // The free block immediately before the epilogue, or NULL.  It remains
+    // linked in its size class, but searches skip it and only carve from it
+    // when no other free block fits; heap growth extends it in place.
+    sf_block *wilderness;
+
+    // Root of the size-ordered index over the top free list class
+    sf_block *large_root;
+
+    // Counters reported by sf_stats, updated under the arena lock
+    unsigned long quick_misses[NUM_QUICK_LISTS];
+    unsigned long list_hits[NUM_FREE_LISTS];
+    unsigned long list_misses[NUM_FREE_LISTS];
+    unsigned long splits[NUM_FREE_LISTS];
+    unsigned long coalesces[NUM_FREE_LISTS];
+    size_t free_bytes;           // bytes in blocks on the free lists, wilderness included
+
+    // Bytes of every block the arena manages, wilderness included; all but free_bytes
+    // of them are allocated.  The main arena does not count secondary arena chunks.
+    size_t managed_bytes;
+    size_t peak_allocated;       // largest managed_bytes - free_bytes after an allocation
+
+    // Pages released by trimming that nothing has been allocated over since, or NULL
+    char *decommit_start;
+    char *decommit_end;
+
+    // Each class list is kept as consecutive sub-bin segments, see sf_set_sub_bins.
+    // sub_bin_heads[i][j] is the first block of segment j of class i, or NULL; bit j of
+    // sub_bin_masks[i] is set when it is not NULL, and bit i of sub_bin_classes when
+    // any segment of class i is non-empty.
+    sf_block *sub_bin_heads[NUM_FREE_LISTS][MAX_SUB_BINS];
+    unsigned int sub_bin_masks[NUM_FREE_LISTS];
+    unsigned int sub_bin_classes;
+
+    // Free blocks below the top class, the wilderness aside, counted by size at
+    // size / ALIGN_SIZE - 1.  Bit i of small_free_sizes[i / 64] is set when count i is
+    // not zero, and bit w of small_free_words when small_free_sizes[w] is not.
+    unsigned int small_free_counts[SMALL_FREE_SIZES];
+    unsigned long small_free_sizes[SMALL_FREE_SIZES / 64];
+    unsigned int small_free_words;
+
+    // Largest top class block other than the wilderness, or 0
+    size_t large_free_max;
+
+    // Adaptive quick list state, see sf_set_quick_budget
+    int quick_capacity[NUM_QUICK_LISTS];
+    unsigned long quick_hits[NUM_QUICK_LISTS];
+    unsigned long quick_flushes[NUM_QUICK_LISTS];
+    unsigned long quick_window_hits[NUM_QUICK_LISTS];  // hits since the list last filled
+    int quick_cold_fills[NUM_QUICK_LISTS];             // consecutive fills without a hit
+
+    // Free cache line blocks kept for sf_malloc_cacheline, one LIFO bin per payload
+    // size.  They are marked like quick list blocks so they are never coalesced.
+    sf_block *cacheline_bins[CACHELINE_CLASSES];
+    int cacheline_lengths[CACHELINE_CLASSES];
+
+    // Storage for secondary arenas; the main arena points at the sfmm.h globals
+    __typeof__(sf_quick_lists[0]) arena_quick_lists[NUM_QUICK_LISTS];
+    sf_block arena_free_list_heads[NUM_FREE_LISTS];
+} sf_arena;
+
+extern sf_arena main_arena;
+
+/*
+ * Enables multi-arena mode.  Each thread is bound, on its first allocation,
+ * to one of count arenas (the main arena included) in round-robin order.
+ * Frees and reallocs always go back to the arena that owns the block, whichever
+ * thread makes them.  Should be called before any other thread allocates.
+ *
+ * @param count Number of arenas to use, between 1 and MAX_ARENAS.
+ *
+ * @return 0 on success.  If count is out of range or smaller than the number of
+ * arenas already in use, -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_arenas(int count);
+
+#define TCACHE_MAX_CAPACITY 64  /* Largest per-bin capacity accepted by sf_set_tcache. */
+
+/*
+ * Per-thread cache counters, one entry per quick list size class.
+ */
+typedef struct {
+    unsigned long hits[NUM_QUICK_LISTS];    // mallocs served from the thread's bin
+    unsigned long misses[NUM_QUICK_LISTS];  // mallocs that found the bin empty
+    unsigned long refills;                  // batches pulled from the arena
+    unsigned long flushes;                  // batches returned to the arenas
+} sf_tcache_counters;
+
+/*
+ * Enables a per-thread cache of quick list sized blocks in front of the arenas.
+ * Each thread keeps a LIFO bin per quick list class that malloc and free use
+ * without taking any lock.  An empty bin is refilled with a batch of blocks, and
+ * a full one is flushed back to the owning arenas, under one lock per batch.
+ * Bins are flushed when their thread exits.  Should be called before other
+ * threads allocate.
+ *
+ * @param capacity Blocks each bin may hold, up to TCACHE_MAX_CAPACITY; 0 disables the cache.
+ *
+ * @return 0 on success.  If capacity is out of range, -1 is returned and sf_errno
+ * is set to EINVAL.
+ */
+int sf_set_tcache(int capacity);
+
+/*
+ * Copies the calling thread's cache counters into counters.
+ */
+void sf_tcache_stats(sf_tcache_counters *counters);
+
+#define QUICK_ADAPT_MAX   64  /* Largest capacity an adaptive quick list can grow to. */
+#define QUICK_COLD_FILLS   4  /* Consecutive fills without a reuse before a class shrinks. */
+
+/*
+ * Quick list counters of one arena, one entry per quick list size class.
+ */
+typedef struct {
+    int capacity[NUM_QUICK_LISTS];           // blocks the list may hold before it is flushed
+    unsigned long hits[NUM_QUICK_LISTS];     // mallocs served from the list
+    unsigned long flushes[NUM_QUICK_LISTS];  // times the list was flushed
+    size_t reserved;                         // bytes the capacities of all arenas add up to
+    size_t budget;                           // 0 when adaptation is off
+} sf_quick_counters;
+
+/*
+ * Enables adaptive quick list capacities.  Every class starts at QUICK_LIST_MAX.
+ * Whenever a list fills up, a class whose blocks were reused at least a full list's
+ * worth of times since it last filled doubles its capacity, up to QUICK_ADAPT_MAX,
+ * instead of being flushed.  A class that fills QUICK_COLD_FILLS times in a row
+ * without a single reuse halves its capacity.  Growth is refused once the capacities
+ * of all classes in all arenas, in bytes, would exceed the budget, so the memory held
+ * in quick lists stays under it.  Should be called before other threads allocate.
+ *
+ * @param budget Bytes all quick lists may hold together; 0 restores the fixed
+ * QUICK_LIST_MAX capacity.
+ *
+ * @return 0.
+ */
+int sf_set_quick_budget(size_t budget);
+
+/*
+ * Copies the quick list counters of the arena the calling thread allocates from
+ * into counters.
+ */
+void sf_quick_stats(sf_quick_counters *counters);
+
+/*
+ * Counts of how sf_realloc served requests to grow a block.
+ */
+typedef struct {
+    unsigned long in_place;          // grown by absorbing the free block or heap after it
+    unsigned long moved;             // grown by allocating a new block and copying
+    unsigned long bytes_copied;      // payload bytes copied by moves
+    unsigned long bytes_not_copied;  // payload bytes in-place growth did not have to copy
+} sf_realloc_counters;
+
+/*
+ * Copies the realloc counters of all threads into counters.
+ */
+void sf_realloc_stats(sf_realloc_counters *counters);
+
+/*
+ * Allocates zeroed memory for an array of nmemb elements of size bytes each.
+ * Memory above the allocator's high-water mark has never been handed out and
+ * is known to be zero, so only the part of the payload below the mark is cleared.
+ * With a page provider that does not zero its pages, the whole payload is cleared.
+ *
+ * @param nmemb Number of elements.
+ * @param size Size of each element in bytes.
+ *
+ * @return If nmemb or size is 0, then NULL is returned without setting sf_errno.
+ * Otherwise, if the allocation is successful a pointer to a zeroed payload is
+ * returned.  If nmemb * size overflows or the request cannot be satisfied, then
+ * NULL is returned and sf_errno is set to ENOMEM.
+ */
+void *sf_calloc(size_t nmemb, size_t size);
+
+/*
+ * Allocates a block whose payload starts on a cache line boundary and spans
+ * whole cache lines, so it shares no line with any other block's payload.
+ * Payloads of up to CACHELINE_CLASSES lines are served from per-arena bins
+ * that sf_free refills, the rest go through the sf_memalign carving path.
+ * Blocks are freed and reallocated like any other.
+ *
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return If size is 0, then NULL is returned without setting sf_errno.
+ * If size is nonzero, then if the allocation is successful a pointer to a
+ * cache line aligned payload is returned.  If the request cannot be satisfied,
+ * then NULL is returned and sf_errno is set to ENOMEM.
+ */
+void *sf_malloc_cacheline(size_t size);
+
+/*
+ * Allocates count blocks of size bytes each, writing their payload pointers to
+ * out.  The blocks come from the quick list of that size and then from as few
+ * splits of larger free blocks as possible, all under a single lock.
+ *
+ * @param size The number of bytes requested for each block.
+ * @param count The number of blocks requested; out must have room for that many.
+ * @param out Receives the payload pointers.
+ *
+ * @return The number of blocks allocated, written to the front of out.  If it is
+ * less than count (and size and count are nonzero), sf_errno is set to ENOMEM.
+ */
+size_t sf_malloc_batch(size_t size, size_t count, void **out);
+
+/*
+ * Frees count blocks at once.  Every pointer is validated as sf_free would
+ * validate it, and the program aborts if one is invalid or appears twice.  The
+ * blocks then go straight to the main free lists, sorted by address so that
+ * neighbours are coalesced together in one pass.
+ *
+ * @param pps The payload pointers to free.
+ * @param count The number of pointers in pps.
+ */
+void sf_free_batch(void **pps, size_t count);
+
+/*
+ * Frees a block whose requested size the caller already knows, such as a C++
+ * sized operator delete.  In release builds the pointer is trusted: none of
+ * sf_free's validity checks run, and the size selects the thread cache bin or
+ * quick list without decoding the header.  After sf_malloc_cacheline has been
+ * used the header is decoded as in sf_free, since cache line blocks are rounded
+ * beyond their request.  A block that kept a splinter is filed by its request
+ * size and serves requests of that size.  Builds with DEBUG defined run all of
+ * sf_free's checks and also abort if size does not match the block.
+ *
+ * @param pp The payload pointer returned by an allocation function.
+ * @param size The size that was requested when the block was allocated or last reallocated.
+ */
+void sf_free_sized(void *pp, size_t size);
+
+/*
+ * Splits each size class between the first and the top into count sub-bins of
+ * equal size range, as in TLSF.  Every free list in sf_free_list_heads is then
+ * kept as count consecutive segments ordered by sub-bin, so the lists still hold
+ * every free block, and allocation takes a good fit in O(1) through a two-level
+ * bitmap (classes, then sub-bins) instead of scanning a list first-fit.  With
+ * the default of one sub-bin each class is scanned first-fit from its newest
+ * block, so freed blocks are reused in LIFO order as the grading tests expect.
+ * Must be called before the first allocation.
+ *
+ * @param count 1, 2 or MAX_SUB_BINS.
+ *
+ * @return 0 on success.  If count is not allowed or the heap is already in use,
+ * -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_sub_bins(int count);
+
+/*
+ * Releases the memory of free pages at the top of the heap.  If the page provider
+ * can shrink, the main arena's heap gives every whole page of its wilderness past
+ * the first pad bytes back.  Otherwise, as with sf_mem_grow, and for secondary
+ * arenas, the wilderness keeps its size, but those pages are decommitted with
+ * madvise(MADV_DONTNEED).  The pages no longer count towards the resident set,
+ * and the kernel supplies fresh zero pages when an allocation touches them again.
+ *
+ * @param pad Bytes at the start of each wilderness to keep resident.
+ *
+ * @return The number of bytes released.
+ */
+size_t sf_trim(size_t pad);
+
+/*
+ * Trims automatically: whenever a free leaves an arena's wilderness with more
+ * than threshold bytes resident past its first pad bytes, those pages are
+ * released as by sf_trim(pad).  Pages are only released once, until an
+ * allocation uses them again.
+ *
+ * @param threshold Resident bytes that trigger a trim; 0 turns automatic trimming off.
+ * @param pad Bytes at the start of the wilderness to keep resident.
+ */
+void sf_set_trim_threshold(size_t threshold, size_t pad);
+
+#define MMAP_CHUNK_PAGES  16  /* Pages the mmap provider grows the heap by at a time. */
+
+/*
+ * Source of the pages the main arena's heap grows into.  The heap is one
+ * contiguous run of pages from start() to end(); grow() and shrink() move its
+ * end by whole PAGE_SZ pages.  Secondary arenas take their chunks from the main
+ * arena, so they use the same provider.
+ */
+typedef struct sf_page_provider {
+    // Adds up to pages pages at end() and returns how many were added
+    size_t (*grow)(struct sf_page_provider *provider, size_t pages);
+    // Gives back up to pages pages before end() and returns how many were given
+    // back; NULL if the provider cannot shrink, in which case sf_trim decommits
+    size_t (*shrink)(struct sf_page_provider *provider, size_t pages);
+    void *(*start)(struct sf_page_provider *provider);
+    void *(*end)(struct sf_page_provider *provider);
+    size_t chunk_pages;  // smallest number of pages worth growing by
+    int zeroed;          // non-zero if pages are always zero when grow() adds them
+
+    // Region managed by the mmap and buffer providers
+    char *base;
+    char *top;
+    char *limit;
+} sf_page_provider;
+
+/*
+ * Initializes provider as the sfutil pool that sf_mem_grow hands out one page
+ * at a time.  This is the default provider.
+ */
+void sf_provider_sfutil(sf_page_provider *provider);
+
+/*
+ * Initializes provider with an anonymous private mapping of reserve bytes.  The
+ * mapping only reserves address space: pages are committed by the kernel as the
+ * heap first touches them, so reserve can be gigabytes.  The heap grows by
+ * MMAP_CHUNK_PAGES pages at a time, and pages it shrinks away are decommitted.
+ *
+ * @return 0 on success.  If the mapping fails, -1 is returned and sf_errno is set
+ * to ENOMEM.
+ */
+int sf_provider_mmap(sf_page_provider *provider, size_t reserve);
+
+/*
+ * Initializes provider with a buffer supplied by the caller, for heaps in static
+ * or otherwise preallocated memory.  The buffer must outlive the allocator.
+ *
+ * @return 0 on success.  If buffer is NULL or holds less than a page, -1 is
+ * returned and sf_errno is set to EINVAL.
+ */
+int sf_provider_buffer(sf_page_provider *provider, void *buffer, size_t size);
+
+/*
+ * Makes the main arena get its pages from provider, which is copied.  Must be
+ * called before the first allocation.  The grading helpers and sf_show_heap walk
+ * the heap between sf_mem_start() and sf_mem_end(), so they only work with the
+ * sfutil provider.
+ *
+ * @return 0 on success.  If the provider lacks grow, start or end, or the heap is
+ * already in use, -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_page_provider(const sf_page_provider *provider);
+
+#define MAPPED_PREFIX        16                    /* Bytes of a mapping before its block. */
+#define MAPPED_TAG           0x5346204d41505044UL  /* Marks the block behind a mapping prefix. */
+#define MMAP_THRESHOLD_MIN   (4 * PAGE_SZ)         /* Smallest threshold sf_set_mmap_threshold accepts. */
+
+/*
+ * Serves every block of at least threshold bytes, headers included, from an
+ * anonymous mapping of its own instead of the heap.  sf_free unmaps such a block
+ * at once, and sf_realloc resizes it with mremap, so a huge buffer never splits
+ * or fragments the heap.  sf_memalign, sf_malloc_cacheline and the batch calls
+ * always use the heap.
+ *
+ * @param threshold Block size from which blocks are mapped, at least
+ * MMAP_THRESHOLD_MIN; 0, the default, turns mapping off.
+ *
+ * @return 0 on success.  If threshold is non-zero but below MMAP_THRESHOLD_MIN,
+ * -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_mmap_threshold(size_t threshold);
+
+/*
+ * Allocator counters, summed over all arenas.  Quick list counters have one
+ * entry per quick list, free list counters one per size class in
+ * sf_free_list_heads.  Blocks held in thread caches count as in use.
+ */
+typedef struct {
+    unsigned long quick_hits[NUM_QUICK_LISTS];     // mallocs served from the quick list
+    unsigned long quick_misses[NUM_QUICK_LISTS];   // mallocs of the quick list's size that found it empty
+    unsigned long quick_flushes[NUM_QUICK_LISTS];  // times the quick list was flushed
+    unsigned long list_hits[NUM_FREE_LISTS];       // mallocs served from a free block of the class
+    unsigned long list_misses[NUM_FREE_LISTS];     // mallocs of the class no free block fit, left
+                                                   // to the wilderness or heap growth
+    unsigned long splits[NUM_FREE_LISTS];          // free blocks of the class split by an allocation
+    unsigned long coalesces[NUM_FREE_LISTS];       // frees that coalesced into a block of the class
+    size_t bytes_in_use;    // bytes of allocated heap blocks, headers and padding included
+    size_t bytes_free;      // bytes of blocks on the free lists
+    size_t bytes_cached;    // bytes of blocks on the quick lists and cache line bins, at each list's size
+    size_t heap_size;       // bytes between sf_mem_start() and sf_mem_end(), or the provider's heap
+    size_t peak_heap;       // largest heap_size so far
+    unsigned long grow_calls;  // times the heap grew
+    size_t pages_grown;        // pages added by those calls
+    unsigned long mmap_count;  // live mapped blocks
+    size_t mmap_bytes;         // bytes mapped for them
+} sf_stats_counters;
+
+/*
+ * Copies the allocator counters into counters.  Every counter is kept under the
+ * lock the allocator already holds where it changes, so keeping them costs one
+ * increment per event.
+ */
+void sf_stats(sf_stats_counters *counters);
+
+#define FRAG_FOLD_EVENTS  64  /* Requests a thread records before adding them to the shared totals. */
+
+/*
+ * Utilization and fragmentation of the heap, kept up to date as the allocator
+ * runs.  Blocks on quick lists, cache line bins and thread caches count as
+ * allocated, and mapped blocks are left out.
+ */
+typedef struct {
+    size_t heap_size;        // bytes of heap now
+    size_t peak_heap;        // largest heap_size so far
+    size_t allocated_bytes;  // bytes of blocks not on a free list, headers included
+    size_t peak_allocated;   // largest allocated_bytes of each arena, added up
+    double peak_utilization; // peak_allocated / peak_heap
+
+    // Internal fragmentation, over every allocation so far
+    size_t requested_bytes;  // payload bytes asked for
+    size_t rounding_bytes;   // bytes 8-byte rounding and the minimum block size added
+    size_t splinter_bytes;   // bytes left in blocks because splitting them off would leave a splinter
+    double internal_fragmentation;  // (rounding + splinter bytes) / bytes of the blocks handed out
+
+    // External fragmentation, now
+    size_t free_bytes;       // bytes of blocks on the free lists
+    size_t largest_free;     // largest of those blocks
+    double external_fragmentation;  // 1 - largest_free / free_bytes, 0 if nothing is free
+} sf_frag_counters;
+
+/*
+ * Copies the utilization and fragmentation figures into report without walking
+ * the heap: every figure is maintained as blocks are allocated and freed, except
+ * the largest free block, which only takes a look at the highest non-empty size
+ * class.  Allocation totals are gathered per thread and added to the shared
+ * totals every FRAG_FOLD_EVENTS requests, so up to that many of another thread's
+ * most recent requests may be missing.  With several arenas, peak_allocated adds
+ * up the peak of each arena, which bounds the peak of the whole heap from above.
+ */
+void sf_frag_report(sf_frag_counters *report);
+
+#define SF_TRACE_MAGIC    "SFTR"  /* First bytes of a trace written by sf_trace_start. */
+#define SF_TRACE_VERSION  1       /* Byte after the magic. */
+
+/*
+ * Op bytes of a trace record.  The letters of the first three match the ops of a
+ * CMU malloclab trace, which the replay driver in bench/ also reads.
+ */
+#define SF_TRACE_MALLOC    'a'  /* id, size */
+#define SF_TRACE_FREE      'f'  /* id */
+#define SF_TRACE_REALLOC   'r'  /* id, size */
+#define SF_TRACE_MEMALIGN  'm'  /* id, size, alignment */
+#define SF_TRACE_CALLOC    'c'  /* id, size: nmemb * size of the call */
+
+/*
+ * Starts recording every allocation call to a trace at path.  A trace is the magic
+ * and version byte, then one record per call: the op byte followed by its fields,
+ * each an unsigned LEB128 varint.  Blocks get logical IDs rather than addresses, so
+ * a trace can be replayed against any allocator; the ID of a freed block is given
+ * to the next allocation, keeping IDs below the most blocks ever live at once.
+ * Batch calls are recorded one block at a time and sf_malloc_cacheline as a
+ * CACHE_LINE_SIZE aligned memalign.  Failed calls are not recorded, nor are frees
+ * of blocks allocated before recording started.
+ *
+ * Calls are serialized while recording, so that the records of one block are in
+ * the order its calls returned.
+ *
+ * @return 0 on success.  If recording is already on, -1 is returned and sf_errno
+ * is set to EINVAL; if the file cannot be opened, -1 is returned and sf_errno is
+ * set to the error from opening it.
+ */
+int sf_trace_start(const char *path);
+
+/*
+ * Stops recording and closes the trace.  Does nothing if recording is off.
+ */
+void sf_trace_stop();
+
+/*
+ * Debug builds, and profile builds (make profile, which defines PROFILE), time
+ * sf_malloc, sf_free, sf_realloc and sf_memalign into log-bucketed histograms,
+ * one per entry point and path.  Other builds leave the timing out entirely.
+ */
+#if defined(DEBUG) || defined(PROFILE)
+#define LATENCY_HISTOGRAMS
+#endif
+
+#define LATENCY_MALLOC    0
+#define LATENCY_FREE      1
+#define LATENCY_REALLOC   2
+#define LATENCY_MEMALIGN  3
+#define LATENCY_ENTRIES   4
+
+/*
+ * Path a call took, the slowest of what it did.  A call that neither searched,
+ * split or coalesced free list blocks nor called into the page provider or the
+ * kernel took the quick path: quick list, cache line bin and thread cache hits,
+ * frees to those, and reallocs that fit the block they were given.
+ */
+#define LATENCY_QUICK     0  /* Quick list, cache line bin or thread cache. */
+#define LATENCY_LIST      1  /* Free list search, split or coalesce. */
+#define LATENCY_MEMORY    2  /* getMemory, trimming, or a mapped block's mmap, mremap or munmap. */
+#define LATENCY_PATHS     3
+
+#define LATENCY_SUB_BUCKETS  4    /* Buckets per power of two. */
+#define LATENCY_BUCKETS      256  /* Enough for any 64-bit count. */
+
+/*
+ * Percentiles of one histogram, in the timer's units: TSC cycles on x86, and
+ * nanoseconds elsewhere.  Each is the upper bound of the bucket it falls in, so
+ * it overstates the true value by at most a quarter.
+ */
+typedef struct {
+    unsigned long count;
+    unsigned long p50;
+    unsigned long p99;
+    unsigned long p999;
+    unsigned long max;
+} sf_latency_summary;
+
+/*
+ * Fills summary from the histogram of entry (LATENCY_MALLOC to LATENCY_MEMALIGN)
+ * and path (LATENCY_QUICK to LATENCY_MEMORY).  Builds without the histograms
+ * leave it zeroed.
+ */
+void sf_latency(int entry, int path, sf_latency_summary *summary);
+
+/*
+ * Prints the count, p50, p99, p99.9 and maximum of every histogram that has
+ * samples to stdout.
+ */
+void sf_latency_dump();
+
+/*
+ * Empties every histogram.
+ */
+void sf_latency_reset();
+
+#define SAMPLE_DEPTH         32         /* Most frames kept of a sampled allocation's backtrace. */
+#define SAMPLE_RECHECK       (1 << 20)  /* Bytes a thread allocates between checks while sampling is off. */
+#define SAMPLE_FILTER_SIZE   4096       /* Counters of the filter sf_free checks for sampled blocks. */
+
+/*
+ * Turns heap sampling on, taking a sample about every rate bytes of allocation,
+ * or off if rate is 0.  sf_malloc, sf_calloc, sf_memalign and sf_realloc count
+ * each request down from a random interval with a mean of rate bytes, which is
+ * all sampling costs them until the count drops below zero.  The request that
+ * takes it there captures its backtrace, and its block is kept in a table of
+ * sampled blocks until it is freed.  Frees check a small counting filter for
+ * sampled blocks, and only take the profiler's lock on a hit.  To the sampler a
+ * realloc is a new request: the block it leaves is sampled or not afresh.
+ *
+ * The calling thread starts counting at once; other threads notice the change
+ * within SAMPLE_RECHECK bytes of allocation if sampling was off, and at their
+ * next sample otherwise.
+ */
+void sf_set_heap_sampling(size_t rate);
+
+/*
+ * Writes the live sampled blocks to path, grouped by call site, in the folded
+ * stack format flame graph tools read: one line per backtrace, its frames from
+ * the outermost call in, separated by semicolons, then a space and the bytes
+ * live from it.  Each sample counts for the bytes it stands for on average, so
+ * the lines add up to an estimate of all live payload bytes.  Frames are
+ * function names where the symbol table has them (link with -rdynamic) and
+ * addresses otherwise.
+ *
+ * @return 0 on success.  If the file cannot be written, -1 is returned and
+ * sf_errno is set to the error from opening it.
+ */
+int sf_heap_profile(const char *path);
+
+#endif
@@ -2,31 +2,343 @@
  * Do not submit your assignment with a main function in this file.
  * If you submit with a main function in this file, you will get a zero.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
 #include <errno.h>
+#include <execinfo.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #define SIZE 0xFFFFFFFFFFFFFFF8 
 
+// Open addressing table from pointers to values, kept at most half full.  Used by the
+// trace recorder and the heap profiler, under their own locks.
+struct pointer_table {
+    void **keys;
+    unsigned long *values;
+    size_t capacity;
+    size_t live;
+};
+
 sf_block *checkQuickList(size_t adjSize);
 sf_block *checkFreeList(size_t adjSize, size_t ogSize);
-sf_block *getMemory();
+size_t pagesNeeded(size_t adjSize);
+sf_block *getMemory(size_t pages);
+size_t trimArena(size_t pad, size_t min_release);
+size_t shrinkHeap(size_t pad, size_t min_release);
+void *heapStart();
+void countRequest(size_t size, size_t adjSize, size_t blockSize);
+void foldFragTotals();
+void updatePeak();
+size_t largestFree();
+void countFreeSize(size_t size, int delta);
+size_t largestTopBlock();
+sf_block *mapBlock(size_t adjSize);
+sf_block *remapBlock(sf_block *block, size_t adjSize);
+void unmapBlock(sf_block *block);
+int isMappedBlock(sf_block *block);
+void *heapEnd();
+size_t sfutilGrow(sf_page_provider *provider, size_t pages);
+void *sfutilStart(sf_page_provider *provider);
+void *sfutilEnd(sf_page_provider *provider);
+size_t regionGrow(sf_page_provider *provider, size_t pages);
+size_t regionShrink(sf_page_provider *provider, size_t pages);
+size_t mmapShrink(sf_page_provider *provider, size_t pages);
+void *regionStart(sf_page_provider *provider);
+void *regionEnd(sf_page_provider *provider);
 sf_block *setFreeBlock(sf_block *pointer, size_t size, int option);
 sf_block *setAllocBlock(sf_block *pointer, size_t size);
 sf_block *splitFreeBlock(sf_block *block, size_t adjSize);
 int getIndex(size_t size);
+int getQuickIndex(size_t size);
+int getSubBin(int index, size_t size);
+sf_block *subBinFit(size_t adjSize);
+void addToQuickList(sf_block *block, int index);
+int quickCapacity(int index);
+int adaptQuickCapacity(int index);
+size_t resetQuickCapacity(sf_arena *arena);
+void flushQuickList(int index);
+sf_block *sortByAddress(sf_block *chain);
+sf_block *mergeByAddress(sf_block *chain);
+void flushBlocks(sf_block *chain, int lock);
+sf_block *carveBlocks(size_t adjSize, size_t count);
+sf_block *allocateChain(size_t adjSize, size_t count);
+sf_block *freeToMainList(sf_block *block);
 void addToFreeList(sf_block *block);
 void removeFromFreeList(sf_block *block);
 sf_block *coalesce(sf_block *block);
+sf_block **treeChildren(sf_block *block);
+int treeKeyLess(sf_block *a, size_t size, sf_block *address);
+uintptr_t treePriority(sf_block *block);
+sf_block *treeRotate(sf_block *root, int dir);
+sf_block *treeInsert(sf_block *root, sf_block *block);
+sf_block *treeRemove(sf_block *root, sf_block *block);
+sf_block *treeLowerBound(sf_block *root, size_t size, sf_block *address);
+sf_block *treeBestFit(size_t adjSize);
+int growInPlace(sf_block *block, size_t adjSize);
+sf_block *allocateAligned(size_t adjSize, size_t align);
+size_t alignedLead(sf_block *block, size_t align);
+sf_block *carveAligned(sf_block *block, size_t lead, size_t adjSize);
+int getCachelineIndex(sf_block *block, size_t size);
+void addToCachelineBin(sf_block *block, int index);
+void clearPayload(sf_block *block, char *clean);
+sf_block *allocateBlock(size_t adjSize, size_t ogSize);
+void freeBlock(sf_block *block);
+void freeSizedBlock(sf_block *block, size_t adjSize);
+int checkBlock(void *pp);
+sf_arena *threadArena();
+sf_arena *findArena(sf_block *block);
+sf_block *getArenaChunk(size_t adjSize);
+int checkBlockHeader(sf_block *block);
+sf_block *tcacheAllocate(size_t adjSize);
+int tcacheFree(sf_block *block);
+void tcachePush(sf_block *block, int index);
+void tcacheFlush(int index);
+void tcacheRelease(void *cache);
+int traceEnter();
+void traceRecord(int op, void *old, void *pp, size_t size, size_t align);
+void traceLeave();
+void traceVarint(size_t value);
+size_t tableSlot(struct pointer_table *table, void *key);
+int tableInsert(struct pointer_table *table, void *key, unsigned long value);
+long tableFind(struct pointer_table *table, void *key);
+long tableTake(struct pointer_table *table, void *key);
+void tableClear(struct pointer_table *table);
+int sampleEnter();
+void sampleLeave(void *pp, size_t size, size_t weight);
+void sampleRestore(void *pp, unsigned long site, size_t size, size_t weight);
+size_t sampleFree(void *pp, unsigned long *site, size_t *weight);
+long sampleInterval(size_t rate);
+size_t sampleFilterIndex(void *pp);
+void sampleAdd(void *pp, size_t size, size_t weight, void **frames, int depth);
+void sampleFile(void *pp, unsigned long site, size_t size, size_t weight);
+void sampleFrame(FILE *file, void *frame, const char *symbol);
+void traceClose();
+int latencyEnter();
+void latencyLeave(int entry);
+unsigned long latencyNow();
+int latencyBucket(unsigned long value);
+unsigned long latencyBound(int bucket);
 
 sf_block *prologue = NULL;
-sf_block *epilogue = NULL;
-int freelist_intialized = -1;
+
+// Where the main arena's pages come from, see sf_set_page_provider
+sf_page_provider page_provider = {
+    .grow = sfutilGrow,
+    .start = sfutilStart,
+    .end = sfutilEnd,
+    .chunk_pages = 1,
+};
+
+// The main arena owns the sf_mem_grow heap and the lists declared in sfmm.h
+sf_arena main_arena = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .quick_lists = sf_quick_lists,
+    .free_list_heads = sf_free_list_heads,
+    .lists_initialized = -1,
+};
+
+// Arena every helper below operates on, set by the entry points while they hold its lock
+__thread sf_arena *cur_arena = &main_arena;
+
+// Arena this thread allocates from once multi-arena mode is on
+__thread sf_arena *thread_arena = NULL;
+
+// arenas[0] is the main arena, the rest point into secondary_arenas
+sf_arena secondary_arenas[MAX_ARENAS - 1];
+sf_arena *arenas[MAX_ARENAS] = { &main_arena };
+int arena_count = 1;
+unsigned int next_arena = 0;
+
+// Address ranges of every secondary arena chunk, sorted by start address so findArena
+// can binary search them.  Chunks are only ever added, under the main arena lock, and
+// never overlap.  findArena reads the table without a lock: arena_chunks_seq is odd
+// while an insert shifts entries up, and a reader that sees it change retries.  Every
+// entry field is read and written atomically.
+struct {
+    char *start;
+    char *end;
+    sf_arena *arena;
+} arena_chunks[MAX_ARENA_CHUNKS];
+int num_arena_chunks = 0;
+unsigned int arena_chunks_seq = 0;
+
+// Per-thread cache of quick list sized blocks in front of the arenas.  Cached blocks
+// stay marked allocated so they are never coalesced.  Their headers are never written
+// without the arena lock, since the arena updates the prev alloc bit of a neighbour
+// under that lock; instead the prev link of a cached block holds TCACHE_TAG, which
+// lets a double free into the cache be caught.
+int tcache_capacity = 0;
+char tcache_tag;
+#define TCACHE_TAG ((sf_block *)&tcache_tag)
+
+struct sf_tcache {
+    sf_block *bins[NUM_QUICK_LISTS];
+    int lengths[NUM_QUICK_LISTS];
+    int registered;
+};
+
+__thread struct sf_tcache tcache;
+__thread sf_tcache_counters tcache_counters;
+
+// Flushes a thread's bins back to the arenas when the thread exits
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Realloc outcomes.  Reallocs in every arena update them, so they are only updated atomically.
+sf_realloc_counters realloc_counters;
+
+// High-water mark: end of the highest block ever allocated.  With a provider whose
+// pages are zero, above the mark the only non-zero words are the header and list and
+// tree links of a wilderness starting at or below it, the wilderness footer and the
+// epilogue.  Other providers' pages are never trusted.  Only main arena blocks can pass
+// it, so it only moves under the main lock.
+char *zero_mark = NULL;
+
+// Automatic trimming, see sf_set_trim_threshold; a threshold of 0 turns it off
+size_t trim_threshold = 0;
+size_t trim_pad = 0;
+
+// Blocks of at least mmap_threshold bytes get a mapping of their own; 0 turns that
+// off.  mmap_used stays set once it has been on, since mapped blocks may still be live.
+size_t mmap_threshold = 0;
+int mmap_used = 0;
+
+// Live mapped blocks and their bytes.  Mapping takes no lock, so only updated atomically.
+unsigned long mmap_count = 0;
+size_t mmap_bytes = 0;
+
+// Heap growth, for sf_stats; only updated under the main arena lock
+unsigned long grow_calls = 0;
+size_t pages_grown = 0;
+size_t peak_heap = 0;
+
+// Allocation stream totals for sf_frag_report.  Each thread adds to its own copy and
+// folds it into the shared one every FRAG_FOLD_EVENTS requests, so the shared totals
+// are only touched, atomically, once per batch.
+struct frag_totals {
+    size_t requested;      // payload bytes asked for
+    size_t rounding;       // bytes rounding and the minimum block size added to them
+    size_t splinters;      // bytes left in blocks that were not split off
+    size_t blocks;         // bytes of the blocks handed out
+    unsigned long events;
+};
+struct frag_totals frag_shared;
+__thread struct frag_totals frag_local;
+
+// Trace recording, see sf_trace_start.  While trace_file is set every entry point
+// takes trace_lock and calls itself again with trace_nested set, so calls one entry
+// point makes to another are not recorded twice.
+FILE *trace_file = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread int trace_nested = 0;
+
+// Blocks live in the trace, from payload to logical ID, and the IDs freed blocks
+// gave back, reused last in first out
+struct pointer_table trace_blocks;
+unsigned long *trace_free_ids = NULL;
+size_t trace_free_count = 0;
+unsigned long trace_next_id = 0;
+
+#ifdef LATENCY_HISTOGRAMS
+// Latency histograms, see sf_latency.  An entry point times itself unless another
+// entry point called it, and the helpers under it raise latency_path to the slowest
+// path they take.  Calls in every arena share the buckets, so they are only updated
+// atomically.
+unsigned long latency_buckets[LATENCY_ENTRIES][LATENCY_PATHS][LATENCY_BUCKETS];
+__thread int latency_nested = 0;
+__thread int latency_path = LATENCY_QUICK;
+__thread unsigned long latency_start = 0;
+#define LATENCY_PATH(path) (latency_path = latency_path > (path) ? latency_path : (path))
+#else
+#define LATENCY_PATH(path)
+#endif
+
+// Heap sampling, see sf_set_heap_sampling.  Each thread counts its requests down in
+// sample_countdown.  A call that may sample sets sample_nested while it calls itself
+// again, and puts the countdown back afterwards, so calls made inside it are neither
+// sampled nor counted.
+size_t sample_rate = 0;
+__thread long sample_countdown = 0;
+__thread int sample_nested = 0;
+__thread unsigned long sample_seed = 0;
+
+// Live samples, each in a slot found through sample_blocks, and the call sites they
+// came from, found through sample_site_index by the hash of their backtrace.  Only
+// touched under sample_lock, except sample_filter, which counts the live samples
+// hashing to each entry, and sample_live, so that frees can skip the lock.
+struct sample_slot {
+    unsigned long site;
+    size_t size;
+    size_t weight;    // bytes the sample stands for
+};
+struct sample_site {
+    void *frames[SAMPLE_DEPTH];
+    int depth;
+    size_t bytes;
+};
+pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+struct pointer_table sample_blocks;
+struct pointer_table sample_site_index;
+struct sample_slot *sample_slots = NULL;
+unsigned long *sample_free_slots = NULL;
+size_t sample_slot_count = 0;
+size_t sample_slot_capacity = 0;
+size_t sample_free_count = 0;
+struct sample_site *sample_sites = NULL;
+size_t sample_site_count = 0;
+size_t sample_site_capacity = 0;
+unsigned int sample_filter[SAMPLE_FILTER_SIZE];
+unsigned long sample_live = 0;
+
+// Sub-bins per size class, fixed by sf_set_sub_bins before the first allocation
+int sub_bins = 1;
+
+// Set by the first sf_malloc_cacheline.  From then on sf_free sends cache line
+// aligned blocks of a bin size to the bins instead of the quick lists.
+int cacheline_used = 0;
+
+// Adaptive quick list budget, 0 when capacities are fixed at QUICK_LIST_MAX.
+// quick_reserved adds up the capacities of every arena in bytes; arenas adapt under
+// their own locks, so it is only updated atomically.
+size_t quick_budget = 0;
+size_t quick_reserved = 0;
 
 void *sf_malloc(size_t size) {
+    if(trace_file != NULL && traceEnter()) {
+        void *pp = sf_malloc(size);
+        traceRecord(SF_TRACE_MALLOC, NULL, pp, size, 0);
+        traceLeave();
+        return pp;
+    }
+
+#ifdef LATENCY_HISTOGRAMS
+    if(latencyEnter()) {
+        void *pp = sf_malloc(size);
+        latencyLeave(LATENCY_MALLOC);
+        return pp;
+    }
+#endif
+
+    // Heap sampling costs one decrement until a sample is due
+    if((sample_countdown -= (long)size) < 0 && sampleEnter()) {
+        long countdown = sample_countdown;
+        void *pp = sf_malloc(size);
+        sample_countdown = countdown;
+        sampleLeave(pp, size, 0);
+        return pp;
+    }
+
     /* NOTES
     - word as 2 bytes (16 bits)
     - memory row as 4 words (64 bits)
@@ -94,6 +406,7 @@ void *sf_malloc(size_t size) {
         return NULL;
     
     // Non-zero:
+    size_t requested = size;
     size_t total_size = size + 8;
     if(total_size % 8 != 0) {
         total_size = total_size + 8 - (total_size % 8);
@@ -104,24 +417,65 @@ void *sf_malloc(size_t size) {
         total_size = 32;
         size = 32;
     }
-    
-    // First check quicklist 
-    sf_block *block = checkQuickList(total_size);
-    if(block != NULL) {
-        return block;
+
+    // Huge blocks bypass the heap entirely
+    if(mmap_threshold != 0 && total_size >= mmap_threshold) {
+        sf_block *mapped = mapBlock(total_size);
+        if(mapped == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        countRequest(requested, total_size, total_size);
+        return (char *)mapped + 8;
     }
 
-    // Then check main free list
-    void *alloc_block = checkFreeList(total_size, size);
+    // A thread cache hit needs no lock at all
+    if(tcache_capacity > 0) {
+        sf_block *cached = tcacheAllocate(total_size);
+        if(cached != NULL) {
+            countRequest(requested, total_size, cached->header & SIZE);
+            return (char *)cached + 8;
+        }
+    }
+    
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    sf_block *alloc_block = allocateBlock(total_size, size);
+    pthread_mutex_unlock(&arena->lock);
+
+    // A secondary arena that cannot get another chunk falls back to the main arena
+    if(alloc_block == NULL && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        cur_arena = &main_arena;
+        alloc_block = allocateBlock(total_size, size);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
 
     if(alloc_block == NULL) {
         sf_errno = ENOMEM;
         return NULL;
     }
 
+    countRequest(requested, total_size, alloc_block->header & SIZE);
     return (char *)alloc_block + 8;
 }
 
+sf_block *allocateBlock(size_t adjSize, size_t ogSize) {
+    // Allocates a block of adjSize bytes from cur_arena, whose lock the caller holds
+
+    // First check quicklist 
+    sf_block *block = checkQuickList(adjSize);
+
+    // Then check main free list
+    if(block == NULL) {
+        block = checkFreeList(adjSize, ogSize);
+    }
+
+    updatePeak();
+    return block;
+}
+
 sf_block *checkQuickList(size_t adjSize) {
     /*  Quick List:
     - sf_quick_lists[NUM_QUICK_LISTS] os size [20] contains pointers to the quick lists in LIFO fashion
@@ -132,45 +486,26 @@ sf_block *checkQuickList(size_t adjSize) {
         to the main free list, after coalescing, if possible.
     */   
 
-    // Finds the first free space in a quicklist and returns a pointer
-    // else returns NULL if no free space found
-
-    if(adjSize < 32 + ((NUM_QUICK_LISTS - 1)* 8))
+    // Pops the first block of the quick list holding exactly adjSize
+    // else returns NULL if there is no such list or it is empty
+    int index = getQuickIndex(adjSize);
+    if(index < 0)
         return NULL;
 
-    // Find appropriate index for size in quick list
-    int index = 0;
-    while(index < NUM_QUICK_LISTS) {
-        int quick_size = 32 + (index * 8);
-
-        if(adjSize <= quick_size) {
-            // Search for free blocks in this index
-            if(sf_quick_lists[index].length > 0) {
-                sf_quick_lists[index].length -= 1;
-
-                sf_block *block = sf_quick_lists[index].first;
-                block->header &= ~IN_QUICK_LIST;
-
-                // Adjust the linked list
-                sf_block *new_first = block->body.links.next;
-                sf_quick_lists[index].first = new_first;
-                new_first->body.links.prev = NULL;
-
-                // Set block links to NULL
-                block->body.links.next = NULL;
-                block->body.links.prev = NULL;
-
-                removeFromFreeList(block);
-                return setAllocBlock(block, block->header & SIZE);
-            }
-
-            break;
-        }
-
-        index++;
+    if(cur_arena->quick_lists[index].length == 0) {
+        cur_arena->quick_misses[index]++;
+        return NULL;
     }
 
-    return NULL;
+    sf_block *block = cur_arena->quick_lists[index].first;
+    cur_arena->quick_lists[index].first = block->body.links.next;
+    cur_arena->quick_lists[index].length -= 1;
+    cur_arena->quick_hits[index]++;
+    cur_arena->quick_window_hits[index]++;
+
+    // Block was never on a main list and its neighbours still see it as allocated
+    block->body.links.next = NULL;
+    return setAllocBlock(block, block->header & SIZE);
 }
 
 sf_block *checkFreeList(size_t adjSize, size_t ogSize) {
@@ -179,578 +514,3306 @@ sf_block *checkFreeList(size_t adjSize, size_t ogSize) {
     // - third list (at index 2) holds blocks of size (2M, 4M]
     // - continues up to the interval (128M, 256M]
 
-    // Find min index with enough space
-    int min = 0;
-    int max = 32;
-    int index = 0;
-    for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        if (adjSize > min && adjSize <= max) {
-            index = i;
-            break;
-        }
+    LATENCY_PATH(LATENCY_LIST);
 
-        /* Update min_size and max_size for the next free list */
-        min = max;
-            max = max * 2;
-    }
+    // Find min index with enough space
+    int index = getIndex(adjSize);
 
     // Intialize sentinal nodes
-    if(freelist_intialized == -1) {
+    if(cur_arena->lists_initialized == -1) {
         for (int i = 0; i < NUM_FREE_LISTS; i++) {
-            sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
-            sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
+            cur_arena->free_list_heads[i].body.links.next = &cur_arena->free_list_heads[i];
+            cur_arena->free_list_heads[i].body.links.prev = &cur_arena->free_list_heads[i];
+        }
+        cur_arena->lists_initialized = 0;
+    }
+
+    // With sub-bins, a good fit comes straight from the two bitmap levels
+    unsigned int candidates = 0;
+    if(sub_bins > 1) {
+        sf_block *fit = subBinFit(adjSize);
+        if(fit == NULL) {
+            fit = treeBestFit(adjSize);
+        }
+        if(fit != NULL) {
+            cur_arena->list_hits[getIndex(fit->header & SIZE)]++;
+            return splitFreeBlock(fit, adjSize);
         }
-        freelist_intialized = 0;
     }
 
-    // Scan free list for free block
-    while (index < NUM_FREE_LISTS) {
-        sf_block *sentinel = &sf_free_list_heads[index];
+    // Else scan only the non-empty lists starting at index, lowest class first
+    else {
+        candidates = cur_arena->nonempty_free_lists & (~0u << index);
+    }
+
+    while (candidates != 0) {
+        index = __builtin_ctz(candidates);
+        sf_block *sentinel = &cur_arena->free_list_heads[index];
         sf_block *current = sentinel->body.links.next;
 
+        // The top class is indexed by size, so it is searched best-fit
+        if(index == NUM_FREE_LISTS - 1) {
+            sf_block *best = treeBestFit(adjSize);
+            if(best != NULL) {
+                cur_arena->list_hits[index]++;
+                return splitFreeBlock(best, adjSize);
+            }
+            current = sentinel;
+        }
+
         while(current != sentinel) {
-            if((current->header & SIZE) >= adjSize) {
+            if((current->header & SIZE) >= adjSize && current != cur_arena->wilderness) {
+                cur_arena->list_hits[index]++;
                 return splitFreeBlock(current, adjSize);
             }
 
             current = current->body.links.next;
         }
-        
-        index++;
+
+        // Clear the lowest set bit and move on to the next non-empty class
+        candidates &= candidates - 1;
     }
 
-    sf_block *block = getMemory();
-    if(block == NULL) {
+    // Carve from the wilderness only once no segregated block fits
+    cur_arena->list_misses[getIndex(adjSize)]++;
+    if(cur_arena->wilderness != NULL && (cur_arena->wilderness->header & SIZE) >= adjSize) {
+        return splitFreeBlock(cur_arena->wilderness, adjSize);
+    }
+
+    // No block fits: grow the heap by every page the request needs in one step,
+    // or give a secondary arena a new chunk
+    sf_block *block;
+    if(cur_arena == &main_arena) {
+        block = getMemory(pagesNeeded(adjSize));
+    }
+    else {
+        block = getArenaChunk(adjSize);
+    }
+
+    if(block == NULL || (block->header & SIZE) < adjSize) {
         return NULL;
     }
 
+    return splitFreeBlock(block, adjSize);
+}
+
+size_t pagesNeeded(size_t adjSize) {
+    // Bytes the heap must grow by so the block before the epilogue holds adjSize
+    size_t need;
+
+    // First page also holds the prologue and epilogue
+    if(cur_arena->epilogue == NULL) {
+        need = adjSize + MIN_BLOCK_SIZE + 8;
+    }
+
+    // New pages extend the wilderness in place
+    else if(cur_arena->wilderness != NULL) {
+        size_t last_size = cur_arena->wilderness->header & SIZE;
+        need = adjSize > last_size ? adjSize - last_size : 0;
+    }
+
+    else {
+        need = adjSize;
+    }
 
-    return checkFreeList(adjSize, ogSize);  
+    return (need + PAGE_SZ - 1) / PAGE_SZ;
 }
 
-sf_block *getMemory() {
-    void *start = sf_mem_grow();
-    // void *beginning = sf_mem_start();
-    void *end = sf_mem_end();
+sf_block *getMemory(size_t pages) {
+    // Grows the heap by up to pages pages, rounded up to the provider's chunk size, and
+    // folds all of them into the wilderness.  Returns the wilderness, which is smaller
+    // than requested if the provider ran out of memory part way, or NULL if no page
+    // could be added at all.
+    size_t chunk = page_provider.chunk_pages;
+    if(chunk > 1) {
+        pages = (pages + chunk - 1) / chunk * chunk;
+    }
 
-    // No more memory 
-    if(start == NULL) {
+    LATENCY_PATH(LATENCY_MEMORY);
+    void *start = heapEnd();
+    size_t grown = page_provider.grow(&page_provider, pages);
+    if(grown == 0) {
         return NULL;
-    }   
+    }
+
+    grow_calls++;
+    pages_grown += grown;
+    size_t heap_size = (size_t)((char *)heapEnd() - (char *)heapStart());
+    if(heap_size > peak_heap) {
+        peak_heap = heap_size;
+    }
+
+    void *end = heapEnd();
+    char *epilogue_start = (char *)end - 8;
 
-    //Set new epilogue
-    if(epilogue != NULL) {
-        // Old epilogue becomes header of new block
-        char *new_epilogue = (char *)end - 8;
+    // Extend the wilderness in place over every new page
+    if(cur_arena->wilderness != NULL) {
+        sf_block *top = cur_arena->wilderness;
+        size_t old_size = top->header & SIZE;
+        size_t new_size = old_size + grown * PAGE_SZ;
 
-        sf_header *new_page = (sf_header *) start;
-        *new_page = (PAGE_SZ - 8) | PREV_BLOCK_ALLOCATED;
+        // The old footer and epilogue end up inside the wilderness
+        *(sf_footer *)((char *)top + old_size - 8) = 0;
+        cur_arena->epilogue->header = 0;
 
-        addToFreeList((sf_block *) new_page);
+        // Set new epilogue
+        cur_arena->epilogue = (sf_block *)epilogue_start;
+        cur_arena->epilogue->header = 0;
+        cur_arena->epilogue->header |= THIS_BLOCK_ALLOCATED;
+
+        // Only relink when the larger block moves to a different size class,
+        // or when its size is the key of the top class index
+        int moved = getIndex(old_size) != getIndex(new_size) || getIndex(old_size) == NUM_FREE_LISTS - 1;
+        if(moved) {
+            removeFromFreeList(top);
+        }
+
+        if((top->header & PREV_BLOCK_ALLOCATED) == 0) {
+            top = setFreeBlock(top, new_size, 0);
+        }
+        else {
+            top = setFreeBlock(top, new_size, 1);
+        }
+
+        if(moved) {
+            addToFreeList(top);
+        }
+        cur_arena->managed_bytes += grown * PAGE_SZ;
+
+        // sf_show_heap();
+        return top;
+    }
+
+    if(cur_arena->epilogue != NULL) {
+        // Last block is allocated: old epilogue becomes header of a new wilderness
+        sf_block *new_block = cur_arena->epilogue;
+        new_block = setFreeBlock(new_block, grown * PAGE_SZ, 1);
 
-        epilogue->header = 8 | THIS_BLOCK_ALLOCATED; // old ep
-        sf_block *old_ep = epilogue;
         // Set new epilogue
-        epilogue = (sf_block *)new_epilogue;
-        epilogue->header = 0;
-        epilogue->header |= THIS_BLOCK_ALLOCATED;
+        cur_arena->epilogue = (sf_block *)epilogue_start;
+        cur_arena->epilogue->header = 0;
+        cur_arena->epilogue->header |= THIS_BLOCK_ALLOCATED;
+
+        addToFreeList(new_block);
+        cur_arena->managed_bytes += grown * PAGE_SZ;
 
         // sf_show_heap();
-        return coalesce(old_ep);
+        return new_block;
     }
 
     // Calculate the number of padding bytes needed to align the block header to an 8-byte boundary
     size_t padding = 0;
     size_t offset = ((size_t)start) % 8;
     if (offset != 0) {
-        padding += 8;
         padding = 8 - offset;
     }
 
     // Header is 8 bytes aligned
     char *header = (char *)start + padding;
     prologue = (sf_block *) header;
-    prologue = setAllocBlock(prologue, 32);
+    prologue = setAllocBlock(prologue, MIN_BLOCK_SIZE);
 
     char *free_start = header + (prologue->header & SIZE);
-    char *epilogue_start = (char *)end - 8;
 
-    // Set free block
+    // Set epilogue
+    cur_arena->epilogue = (sf_block *)epilogue_start;
+    cur_arena->epilogue->header = 0;
+    cur_arena->epilogue->header |= THIS_BLOCK_ALLOCATED;
+
+    // Set free block, which becomes the wilderness
     size_t free_size = (size_t)(epilogue_start - free_start);
     sf_block *free_block = setFreeBlock((sf_block *)free_start, free_size, 1);
     addToFreeList(free_block);
-
-    // Set epilogue
-    epilogue = (sf_block *)epilogue_start;
-    epilogue->header = 0;
-    epilogue->header |= THIS_BLOCK_ALLOCATED;
+    cur_arena->managed_bytes += free_size;
 
     // sf_show_heap();
     return free_block;
-    
 }
 
 
-sf_block *setFreeBlock(sf_block *pointer, size_t size, int option) {   
-    // How to get the top block and check if it's allocated 
-    // Set the bottom block prev alloc to 0 (if there is one)
-    sf_block *free = pointer;
-    free->header = size;
-    free->header &= ~THIS_BLOCK_ALLOCATED;
-    free->header &= ~IN_QUICK_LIST;
-    char *footer_start = (char *)free + size - 8;
-    sf_footer *footer = (sf_footer *)footer_start;
+size_t trimArena(size_t pad, size_t min_release) {
+    // Decommits the whole pages of cur_arena's wilderness past its first pad bytes.
+    // sfutil cannot take pages back, so the block keeps its size and stays in the
+    // heap; the kernel drops the pages and hands out zero pages if they are touched
+    // again.  Returns the bytes released, or 0 if that would be less than min_release.
+    if(cur_arena == &main_arena && page_provider.shrink != NULL) {
+        return shrinkHeap(pad, min_release);
+    }
 
-    // Just free
-    if(option == 0) {
-        *footer = free->header;
+    sf_block *wilderness = cur_arena->wilderness;
+    if(wilderness == NULL) {
+        return 0;
     }
 
-    // Set prev alloc
-    else if(option == 1) {
-        free->header |= PREV_BLOCK_ALLOCATED;
+    // Header, list and tree links at the front and the footer at the back stay resident
+    size_t size = wilderness->header & SIZE;
+    if(size < 48 || pad > size - 48) {
+        return 0;
     }
-    
-    // Set in quicklist
-    else if(option == 2) {
-        free->header |= IN_QUICK_LIST;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *lo = (char *)(((uintptr_t)wilderness + 40 + pad + page - 1) & ~(uintptr_t)(page - 1));
+    char *hi = (char *)(((uintptr_t)wilderness + size - 8) & ~(uintptr_t)(page - 1));
+    if(lo >= hi) {
+        return 0;
     }
-    
-    *footer = free->header;
-    return free;
-}
 
-sf_block *setAllocBlock(sf_block *block, size_t size) {
-    int prev = block->header & PREV_BLOCK_ALLOCATED;
+    // Skip the part an earlier trim released that nothing has been allocated over since
+    char *known_lo = cur_arena->decommit_start;
+    char *known_hi = cur_arena->decommit_end;
+    if(known_lo == NULL || known_hi <= lo || known_lo >= hi) {
+        known_lo = hi;
+        known_hi = hi;
+    }
+    if(known_lo < lo) {
+        known_lo = lo;
+    }
+    if(known_hi > hi) {
+        known_hi = hi;
+    }
 
-    sf_block *alloc = block;
-    alloc->header = size;
+    size_t release = (size_t)(known_lo - lo) + (size_t)(hi - known_hi);
+    if(release == 0 || release < min_release) {
+        return 0;
+    }
 
-    alloc->header |= THIS_BLOCK_ALLOCATED;
-    alloc->header &= ~IN_QUICK_LIST;
+    LATENCY_PATH(LATENCY_MEMORY);
+    if(known_lo > lo && madvise(lo, known_lo - lo, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    if(hi > known_hi && madvise(known_hi, hi - known_hi, MADV_DONTNEED) != 0) {
+        return 0;
+    }
 
-    if(prev == 0) {
-        alloc->header &= ~PREV_BLOCK_ALLOCATED;
+    cur_arena->decommit_start = lo;
+    cur_arena->decommit_end = hi;
+    return release;
+}
+
+size_t shrinkHeap(size_t pad, size_t min_release) {
+    // Hands the whole pages at the end of the main arena's wilderness, past its first
+    // pad bytes, back to a provider that can shrink, and moves the epilogue down.
+    // Returns the bytes released, or 0 if that would be less than min_release.
+    sf_block *wilderness = cur_arena->wilderness;
+    if(wilderness == NULL) {
+        return 0;
     }
-    else {
-        alloc->header |= PREV_BLOCK_ALLOCATED;
+
+    size_t size = wilderness->header & SIZE;
+    if(pad > size - MIN_BLOCK_SIZE) {
+        return 0;
     }
 
+    size_t pages = (size - MIN_BLOCK_SIZE - pad) / PAGE_SZ;
+    if(pages == 0 || pages * PAGE_SZ < min_release) {
+        return 0;
+    }
 
-    return alloc;
-}   
+    LATENCY_PATH(LATENCY_MEMORY);
+    pages = page_provider.shrink(&page_provider, pages);
+    if(pages == 0) {
+        return 0;
+    }
 
-sf_block *splitFreeBlock(sf_block *block, size_t adjSize) {
-    // Remove block from main free list
-    removeFromFreeList(block);
+    // Only the header and links at the front of the wilderness are read from here on
+    removeFromFreeList(wilderness);
+    size_t new_size = size - pages * PAGE_SZ;
+    int prev = (wilderness->header & PREV_BLOCK_ALLOCATED) != 0;
+    wilderness = setFreeBlock(wilderness, new_size, prev);
+
+    cur_arena->epilogue = (sf_block *)((char *)wilderness + new_size);
+    cur_arena->epilogue->header = THIS_BLOCK_ALLOCATED;
+    addToFreeList(wilderness);
+    cur_arena->managed_bytes -= pages * PAGE_SZ;
+
+    // Released pages are no longer part of the heap
+    cur_arena->decommit_start = NULL;
+    cur_arena->decommit_end = NULL;
+    return pages * PAGE_SZ;
+}
 
-    // Splitting would leave splinter(extra space < 32 bytes)
-    if ((block->header & SIZE) - adjSize < 32) {
-        sf_block *alloc = setAllocBlock(block, adjSize);
+size_t sf_trim(size_t pad) {
+    size_t released = 0;
+    int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++) {
+        pthread_mutex_lock(&arenas[i]->lock);
+        cur_arena = arenas[i];
+        released += trimArena(pad, 1);
+        pthread_mutex_unlock(&arenas[i]->lock);
+    }
 
-        // Set next block(epilogue) prev bit to 1
-        char *next_ptr = (char *)alloc + (alloc->header & SIZE);
-        sf_block *next_block = (sf_block *)next_ptr;
-        next_block->header |= PREV_BLOCK_ALLOCATED;
+    return released;
+}
 
-        return block;
+void sf_set_trim_threshold(size_t threshold, size_t pad) {
+    trim_pad = pad;
+    trim_threshold = threshold;
+}
+
+void *heapStart() {
+    return page_provider.start(&page_provider);
+}
+
+void *heapEnd() {
+    return page_provider.end(&page_provider);
+}
+
+size_t sfutilGrow(sf_page_provider *provider, size_t pages) {
+    // sf_mem_grow adds one page at a time until its pool runs out
+    size_t grown = 0;
+    while(grown < pages && sf_mem_grow() != NULL) {
+        grown++;
     }
 
-    // Otherwise, split the free block
-    char *new_free_pointer = (char *)block + adjSize;
-    sf_block *new_free = setFreeBlock((sf_block *)new_free_pointer, (block->header & SIZE) - adjSize, 1);
-    coalesce(new_free);
-    // addToFreeList(new_free);
+    return grown;
+}
 
-    // Create block
-    sf_block *alloc = setAllocBlock(block, adjSize);
+void *sfutilStart(sf_page_provider *provider) {
+    return sf_mem_start();
+}
 
-    // sf_show_heap();
-    return alloc;
-        
+void *sfutilEnd(sf_page_provider *provider) {
+    return sf_mem_end();
 }
 
-int getIndex(size_t size) {
-    if (size <= 32) {
-        return 0;
+size_t regionGrow(sf_page_provider *provider, size_t pages) {
+    // Moves the top of a reserved region up by as many of pages as still fit
+    size_t available = (size_t)(provider->limit - provider->top) / PAGE_SZ;
+    if(pages > available) {
+        pages = available;
     }
 
-    if (size > 256 * 32) {
-        return 9;
+    // Atomic: sf_free reads the end of the heap without the lock
+    __atomic_store_n(&provider->top, provider->top + pages * PAGE_SZ, __ATOMIC_RELAXED);
+    return pages;
+}
+
+size_t regionShrink(sf_page_provider *provider, size_t pages) {
+    size_t used = (size_t)(provider->top - provider->base) / PAGE_SZ;
+    if(pages > used) {
+        pages = used;
     }
 
-    int index = 1;
-    int min = 32;
-    int max = 2 * min;
-    while (index < NUM_FREE_LISTS - 1) {
-        if(size >= min && size < max) {
-            break;
-        }
-        min = max;
-        max = 2 * min;
-        index++;
+    __atomic_store_n(&provider->top, provider->top - pages * PAGE_SZ, __ATOMIC_RELAXED);
+    return pages;
+}
+
+size_t mmapShrink(sf_page_provider *provider, size_t pages) {
+    // Drops the released pages so they stop counting as resident and are zero when the
+    // region grows over them again.  Only whole system pages can be dropped; the rest
+    // of the one the new top falls in is cleared by hand.
+    char *old_top = provider->top;
+    pages = regionShrink(provider, pages);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *aligned = (char *)(((uintptr_t)provider->top + page - 1) & ~(uintptr_t)(page - 1));
+    if(aligned > old_top) {
+        aligned = old_top;
     }
 
-    return index;
+    memset(provider->top, 0, aligned - provider->top);
+    if(aligned < old_top) {
+        madvise(aligned, old_top - aligned, MADV_DONTNEED);
+    }
+
+    return pages;
 }
 
-void addToFreeList(sf_block *block) {
-    int index = getIndex(block->header & SIZE);
+void *regionStart(sf_page_provider *provider) {
+    return provider->base;
+}
 
-    block->body.links.next = &sf_free_list_heads[index];
-    block->body.links.prev = sf_free_list_heads[index].body.links.prev;
-    sf_free_list_heads[index].body.links.prev->body.links.next = block;
-    sf_free_list_heads[index].body.links.prev = block;
+void *regionEnd(sf_page_provider *provider) {
+    return __atomic_load_n(&provider->top, __ATOMIC_RELAXED);
+}
 
+void sf_provider_sfutil(sf_page_provider *provider) {
+    memset(provider, 0, sizeof(*provider));
+    provider->grow = sfutilGrow;
+    provider->start = sfutilStart;
+    provider->end = sfutilEnd;
+    provider->chunk_pages = 1;
 }
 
-void removeFromFreeList(sf_block *block) {
-    block->body.links.prev->body.links.next = block->body.links.next;
-    block->body.links.next->body.links.prev = block->body.links.prev;
-    block->body.links.next = NULL;
-    block->body.links.prev = NULL;
+int sf_provider_mmap(sf_page_provider *provider, size_t reserve) {
+    // Reserve address space only: the kernel commits each page the first time it is
+    // touched, and MAP_NORESERVE keeps untouched pages from counting against swap
+    reserve = reserve / PAGE_SZ * PAGE_SZ;
+    void *base = MAP_FAILED;
+    if(reserve != 0) {
+        base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+
+    if(base == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return -1;
+    }
+
+    memset(provider, 0, sizeof(*provider));
+    provider->grow = regionGrow;
+    provider->shrink = mmapShrink;
+    provider->start = regionStart;
+    provider->end = regionEnd;
+    provider->chunk_pages = MMAP_CHUNK_PAGES;
+    provider->zeroed = 1;
+    provider->base = base;
+    provider->top = base;
+    provider->limit = (char *)base + reserve;
+    return 0;
 }
 
-sf_block *coalesce(sf_block *block) {
-    // Block is a  block that is free/ allocated block just freed
-    // Removes the free adjacent blocks from the free list and adds the nwe coalesced block
-    // Sets block to free and returns a coalesced free block
+int sf_provider_buffer(sf_page_provider *provider, void *buffer, size_t size) {
+    // Align the first page like a block header; the tail that is not a whole page is unused
+    char *base = (char *)(((uintptr_t)buffer + 15) & ~(uintptr_t)15);
+    size_t usable = size > (size_t)(base - (char *)buffer) ? size - (size_t)(base - (char *)buffer) : 0;
+    if(buffer == NULL || usable < PAGE_SZ) {
+        sf_errno = EINVAL;
+        return -1;
+    }
 
-    char *bottom_header = (char *)block + (block->header & SIZE);
-    sf_block *bottom = (sf_block *)bottom_header;
+    memset(provider, 0, sizeof(*provider));
+    provider->grow = regionGrow;
+    provider->shrink = regionShrink;
+    provider->start = regionStart;
+    provider->end = regionEnd;
+    provider->chunk_pages = 1;
+    provider->base = base;
+    provider->top = base;
+    provider->limit = base + usable / PAGE_SZ * PAGE_SZ;
+    return 0;
+}
 
-    // Top and bottom block are free
-    if((block->header & PREV_BLOCK_ALLOCATED) == 0 && (bottom->header & THIS_BLOCK_ALLOCATED) == 0) {
-        // Get top 
-        char *footer = (char *)block - 8;
-        sf_footer *actual_footer = (sf_footer *) footer;
+int sf_set_page_provider(const sf_page_provider *provider) {
+    if(provider == NULL || provider->grow == NULL || provider->start == NULL || provider->end == NULL
+        || main_arena.lists_initialized != -1) {
+        sf_errno = EINVAL;
+        return -1;
+    }
 
-        size_t top_size = *actual_footer & SIZE;
-        size_t current_size = block->header & SIZE;
-        size_t bottom_size = bottom->header & SIZE;
+    page_provider = *provider;
+    if(page_provider.chunk_pages == 0) {
+        page_provider.chunk_pages = 1;
+    }
+    return 0;
+}
 
-        // Remove from free list
-        char *top = (char *)block - top_size;
-        removeFromFreeList((sf_block *)top);
-        removeFromFreeList(bottom);
-        
+sf_block *getArenaChunk(size_t adjSize) {
+    // Carves a chunk big enough for adjSize out of the main arena and lays it out as a
+    // heap of its own: prologue, one free block and an epilogue.  The free block becomes
+    // the arena's wilderness; the previous chunk's tail stays on the free lists.
+    sf_arena *arena = cur_arena;
 
-        // Set new coalesce block
-        sf_block *free;
-        if((*actual_footer & PREV_BLOCK_ALLOCATED) == 0) {
-            free = setFreeBlock((sf_block *)top, top_size + current_size + bottom_size, 0);
-        }
-        else {
-            free = setFreeBlock((sf_block *)top, top_size + current_size + bottom_size, 1);
+    // Room for the chunk's prologue and epilogue around the block
+    size_t chunk_size = adjSize + MIN_BLOCK_SIZE + 8 + 8;
+    if(chunk_size < ARENA_CHUNK_SIZE) {
+        chunk_size = ARENA_CHUNK_SIZE;
+    }
+
+    pthread_mutex_lock(&main_arena.lock);
+    cur_arena = &main_arena;
+
+    // A chunk is not an allocation of the main arena's, so it leaves its peak alone
+    sf_block *chunk = NULL;
+    size_t peak = main_arena.peak_allocated;
+    if(num_arena_chunks < MAX_ARENA_CHUNKS) {
+        chunk = allocateBlock(chunk_size, chunk_size - 8);
+    }
+    main_arena.peak_allocated = peak;
+
+    if(chunk != NULL) {
+        main_arena.managed_bytes -= chunk->header & SIZE;
+        char *start = (char *)chunk + 8;
+        char *end = (char *)chunk + (chunk->header & SIZE);
+
+        unsigned int seq = arena_chunks_seq;
+        __atomic_store_n(&arena_chunks_seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        int slot = num_arena_chunks;
+        for(; slot > 0 && arena_chunks[slot - 1].start > start; slot--) {
+            __atomic_store_n(&arena_chunks[slot].start, arena_chunks[slot - 1].start, __ATOMIC_RELAXED);
+            __atomic_store_n(&arena_chunks[slot].end, arena_chunks[slot - 1].end, __ATOMIC_RELAXED);
+            __atomic_store_n(&arena_chunks[slot].arena, arena_chunks[slot - 1].arena, __ATOMIC_RELAXED);
         }
-         
-        addToFreeList(free);
-        // sf_show_heap();
-        return free;
+        __atomic_store_n(&arena_chunks[slot].start, start, __ATOMIC_RELAXED);
+        __atomic_store_n(&arena_chunks[slot].end, end, __ATOMIC_RELAXED);
+        __atomic_store_n(&arena_chunks[slot].arena, arena, __ATOMIC_RELAXED);
+        __atomic_store_n(&num_arena_chunks, num_arena_chunks + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&arena_chunks_seq, seq + 2, __ATOMIC_RELEASE);
     }
 
-    // Top block is free and bottom is allocated
-    else if((block->header & PREV_BLOCK_ALLOCATED) == 0 && (bottom->header & THIS_BLOCK_ALLOCATED)) {
-        // Get top 
-        char *footer = (char *)block - 8;
-        sf_footer *actual_footer = (sf_footer *) footer;
-        size_t top_size = *actual_footer & SIZE;
-        size_t current_size = block->header & SIZE;
+    cur_arena = arena;
+    pthread_mutex_unlock(&main_arena.lock);
+
+    if(chunk == NULL) {
+        return NULL;
+    }
+
+    char *start = (char *)chunk + 8;
+    char *end = (char *)chunk + (chunk->header & SIZE);
+
+    // Prologue
+    sf_block *chunk_prologue = (sf_block *)start;
+    chunk_prologue->header = MIN_BLOCK_SIZE | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED;
+
+    // Epilogue
+    arena->epilogue = (sf_block *)(end - 8);
+    arena->epilogue->header = THIS_BLOCK_ALLOCATED;
+
+    // The previous chunk's wilderness is an ordinary free block from now on
+    sf_block *old_wilderness = arena->wilderness;
+    if(old_wilderness != NULL) {
+        removeFromFreeList(old_wilderness);
+        addToFreeList(old_wilderness);
+    }
+
+    // Free block, which becomes the wilderness
+    char *free_start = start + MIN_BLOCK_SIZE;
+    sf_block *free_block = setFreeBlock((sf_block *)free_start, (size_t)(end - 8 - free_start), 1);
+    addToFreeList(free_block);
+    arena->managed_bytes += free_block->header & SIZE;
+
+    return free_block;
+}
+
+sf_arena *threadArena() {
+    // Arena the calling thread allocates from, binding it round-robin on first use
+    if(__atomic_load_n(&arena_count, __ATOMIC_ACQUIRE) <= 1) {
+        return &main_arena;
+    }
+
+    if(thread_arena == NULL) {
+        unsigned int next = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = arenas[next % arena_count];
+    }
+
+    return thread_arena;
+}
+
+sf_arena *findArena(sf_block *block) {
+    // Arena owning block: the secondary arena whose chunk contains it, else the main arena
+    for(;;) {
+        unsigned int seq = __atomic_load_n(&arena_chunks_seq, __ATOMIC_ACQUIRE);
+        // An insert is shifting entries; it only takes a few hundred stores
+        if(seq & 1) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#else
+            sched_yield();
+#endif
+            continue;
+        }
+
+        // Last chunk starting at or below block
+        int lo = 0;
+        int hi = __atomic_load_n(&num_arena_chunks, __ATOMIC_RELAXED);
+        while(lo < hi) {
+            int mid = (lo + hi) / 2;
+            if(__atomic_load_n(&arena_chunks[mid].start, __ATOMIC_RELAXED) <= (char *)block) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+
+        sf_arena *owner = &main_arena;
+        if(lo > 0 && (char *)block < __atomic_load_n(&arena_chunks[lo - 1].end, __ATOMIC_RELAXED)) {
+            owner = __atomic_load_n(&arena_chunks[lo - 1].arena, __ATOMIC_RELAXED);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&arena_chunks_seq, __ATOMIC_RELAXED) == seq) {
+            return owner;
+        }
+    }
+}
+
+int sf_set_arenas(int count) {
+    if(count < 1 || count > MAX_ARENAS) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&main_arena.lock);
+
+    // Arenas are never torn down, so the count can only grow
+    if(count < arena_count) {
+        pthread_mutex_unlock(&main_arena.lock);
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    for(int i = arena_count; i < count; i++) {
+        sf_arena *arena = &secondary_arenas[i - 1];
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->quick_lists = arena->arena_quick_lists;
+        arena->free_list_heads = arena->arena_free_list_heads;
+        for(int j = 0; j < NUM_FREE_LISTS; j++) {
+            arena->free_list_heads[j].body.links.next = &arena->free_list_heads[j];
+            arena->free_list_heads[j].body.links.prev = &arena->free_list_heads[j];
+        }
+        arena->lists_initialized = 0;
+        arena->nonempty_free_lists = 0;
+        arena->epilogue = NULL;
+        arena->wilderness = NULL;
+        arena->large_root = NULL;
+        arena->decommit_start = NULL;
+        arena->decommit_end = NULL;
+        memset(arena->sub_bin_heads, 0, sizeof(arena->sub_bin_heads));
+        memset(arena->sub_bin_masks, 0, sizeof(arena->sub_bin_masks));
+        arena->sub_bin_classes = 0;
+        memset(arena->small_free_counts, 0, sizeof(arena->small_free_counts));
+        memset(arena->small_free_sizes, 0, sizeof(arena->small_free_sizes));
+        arena->small_free_words = 0;
+        arena->large_free_max = 0;
+        size_t reserved = resetQuickCapacity(arena);
+        if(quick_budget != 0) {
+            __atomic_add_fetch(&quick_reserved, reserved, __ATOMIC_RELAXED);
+        }
+        arenas[i] = arena;
+    }
+
+    __atomic_store_n(&arena_count, count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&main_arena.lock);
+    return 0;
+}
+
+
+void tcacheCreateKey() {
+    pthread_key_create(&tcache_key, tcacheRelease);
+}
+
+sf_block *tcacheAllocate(size_t adjSize) {
+    // Pops a block of exactly adjSize from this thread's bin.  On a miss the bin is
+    // refilled with a batch of blocks from the thread's arena under a single lock.
+    int index = getQuickIndex(adjSize);
+    if(index < 0) {
+        return NULL;
+    }
+
+    sf_block *block = tcache.bins[index];
+    if(block != NULL) {
+        tcache.bins[index] = block->body.links.next;
+        tcache.lengths[index] -= 1;
+        tcache_counters.hits[index]++;
+
+        block->body.links.next = NULL;
+        block->body.links.prev = NULL;
+        return block;
+    }
+
+    tcache_counters.misses[index]++;
+    if(!tcache.registered) {
+        pthread_once(&tcache_key_once, tcacheCreateKey);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+
+    // One block for the caller plus half a bin for the mallocs that follow
+    int batch = (tcache_capacity + 1) / 2;
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+
+    sf_block *first = allocateChain(adjSize, batch + 1);
+    sf_block *chain = NULL;
+    if(first != NULL) {
+        chain = first->body.links.next;
+        first->body.links.next = NULL;
+    }
+
+    // Reverse the rest so the bin pops them in chain order, right after the block
+    // handed to the caller
+    sf_block *reversed = NULL;
+    while(chain != NULL) {
+        sf_block *next = chain->body.links.next;
+        chain->body.links.next = reversed;
+        reversed = chain;
+        chain = next;
+    }
+
+    while(reversed != NULL) {
+        sf_block *extra = reversed;
+        reversed = reversed->body.links.next;
+
+        extra->body.links.prev = TCACHE_TAG;
+        extra->body.links.next = tcache.bins[index];
+        tcache.bins[index] = extra;
+        tcache.lengths[index] += 1;
+    }
+
+    pthread_mutex_unlock(&arena->lock);
+    tcache_counters.refills++;
+    return first;
+}
+
+int tcacheFree(sf_block *block) {
+    // Pushes a quick list sized block onto this thread's bin, flushing the bin to the
+    // arenas first if it is full.  Returns 0 if the block is not cacheable.
+    size_t size = __atomic_load_n(&block->header, __ATOMIC_RELAXED) & SIZE;
+    int index = getQuickIndex(size);
+    if(index < 0) {
+        return 0;
+    }
+
+    // Cache line blocks go back to their arena's bins
+    if(__atomic_load_n(&cacheline_used, __ATOMIC_RELAXED) && getCachelineIndex(block, size) >= 0) {
+        return 0;
+    }
+
+    // Only checks that need no lock: the previous block may belong to another thread
+    if(checkBlockHeader(block) != 0) {
+        abort();
+    }
+
+    // Tagged block may just hold the tag as data, so confirm it is really in the bin
+    if(block->body.links.prev == TCACHE_TAG) {
+        for(sf_block *cached = tcache.bins[index]; cached != NULL; cached = cached->body.links.next) {
+            if(cached == block) {
+                abort();
+            }
+        }
+    }
+
+    tcachePush(block, index);
+    return 1;
+}
+
+void tcachePush(sf_block *block, int index) {
+    // Pushes a block of quick list index onto this thread's bin, flushing the bin to the
+    // arenas first if it is full
+    if(!tcache.registered) {
+        pthread_once(&tcache_key_once, tcacheCreateKey);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+
+    if(tcache.lengths[index] >= tcache_capacity) {
+        tcacheFlush(index);
+    }
+
+    block->body.links.prev = TCACHE_TAG;
+    block->body.links.next = tcache.bins[index];
+    tcache.bins[index] = block;
+    tcache.lengths[index] += 1;
+}
+
+void tcacheFlush(int index) {
+    // Returns a whole bin to the arenas that own its blocks as one coalesced batch
+    flushBlocks(tcache.bins[index], 1);
+
+    tcache.bins[index] = NULL;
+    tcache.lengths[index] = 0;
+    tcache_counters.flushes++;
+}
+
+void tcacheRelease(void *cache) {
+    // Thread exit: nothing may stay stranded in the dying thread's bins
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) {
+        if(tcache.bins[i] != NULL) {
+            tcacheFlush(i);
+        }
+    }
+    foldFragTotals();
+}
+
+int sf_set_tcache(int capacity) {
+    if(capacity < 0 || capacity > TCACHE_MAX_CAPACITY) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    tcache_capacity = capacity;
+    return 0;
+}
+
+void sf_tcache_stats(sf_tcache_counters *counters) {
+    *counters = tcache_counters;
+}
+
+int sf_set_quick_budget(size_t budget) {
+    // Lists longer than a reset capacity are flushed by their next insertion
+    size_t reserved = 0;
+    int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++) {
+        pthread_mutex_lock(&arenas[i]->lock);
+        reserved += resetQuickCapacity(arenas[i]);
+        pthread_mutex_unlock(&arenas[i]->lock);
+    }
+
+    quick_reserved = reserved;
+    quick_budget = budget;
+    return 0;
+}
+
+void sf_quick_stats(sf_quick_counters *counters) {
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) {
+        counters->capacity[i] = quickCapacity(i);
+        counters->hits[i] = arena->quick_hits[i];
+        counters->flushes[i] = arena->quick_flushes[i];
+    }
+    counters->reserved = (quick_budget != 0) ? __atomic_load_n(&quick_reserved, __ATOMIC_RELAXED) : 0;
+    counters->budget = quick_budget;
+
+    pthread_mutex_unlock(&arena->lock);
+}
+
+
+sf_block *setFreeBlock(sf_block *pointer, size_t size, int option) {   
+    // How to get the top block and check if it's allocated 
+    // Set the bottom block prev alloc to 0 (if there is one)
+    sf_block *free = pointer;
+    free->header = size;
+    free->header &= ~THIS_BLOCK_ALLOCATED;
+    free->header &= ~IN_QUICK_LIST;
+    char *footer_start = (char *)free + size - 8;
+    sf_footer *footer = (sf_footer *)footer_start;
+
+    // Just free
+    if(option == 0) {
+        *footer = free->header;
+    }
+
+    // Set prev alloc
+    else if(option == 1) {
+        free->header |= PREV_BLOCK_ALLOCATED;
+    }
+    
+    // Set in quicklist
+    else if(option == 2) {
+        free->header |= IN_QUICK_LIST;
+    }
+    
+    *footer = free->header;
+    return free;
+}
+
+sf_block *setAllocBlock(sf_block *block, size_t size) {
+    int prev = block->header & PREV_BLOCK_ALLOCATED;
+
+    sf_block *alloc = block;
+    alloc->header = size;
+
+    alloc->header |= THIS_BLOCK_ALLOCATED;
+    alloc->header &= ~IN_QUICK_LIST;
+
+    if(prev == 0) {
+        alloc->header &= ~PREV_BLOCK_ALLOCATED;
+    }
+    else {
+        alloc->header |= PREV_BLOCK_ALLOCATED;
+    }
+
+    // Raise the high-water mark sf_calloc relies on
+    char *end = (char *)alloc + size;
+    if(end > __atomic_load_n(&zero_mark, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&zero_mark, end, __ATOMIC_RELAXED);
+    }
+
+    // Writing to decommitted pages brings them back; past the links of the free block
+    // that may start at end, the rest of the range is still untouched
+    if(end + 40 > cur_arena->decommit_start && (char *)alloc < cur_arena->decommit_end) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *start = (char *)(((uintptr_t)end + 40 + page - 1) & ~(uintptr_t)(page - 1));
+        if(start < cur_arena->decommit_end) {
+            cur_arena->decommit_start = start;
+        }
+        else {
+            cur_arena->decommit_start = NULL;
+            cur_arena->decommit_end = NULL;
+        }
+    }
+
+    return alloc;
+}   
+
+sf_block *splitFreeBlock(sf_block *block, size_t adjSize) {
+    // Remove block from main free list
+    removeFromFreeList(block);
+
+    // Splitting would leave splinter(extra space < 32 bytes)
+    if ((block->header & SIZE) - adjSize < 32) {
+        sf_block *alloc = setAllocBlock(block, block->header & SIZE);
+
+        // Set next block(epilogue) prev bit to 1
+        // Atomic: an allocated neighbour's header may be read by a thread cache without the lock
+        char *next_ptr = (char *)alloc + (alloc->header & SIZE);
+        sf_block *next_block = (sf_block *)next_ptr;
+        __atomic_fetch_or(&next_block->header, PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED);
+
+        return block;
+    }
+
+    // Otherwise, split the free block
+    cur_arena->splits[getIndex(block->header & SIZE)]++;
+    char *new_free_pointer = (char *)block + adjSize;
+    sf_block *new_free = setFreeBlock((sf_block *)new_free_pointer, (block->header & SIZE) - adjSize, 1);
+    coalesce(new_free);
+    // addToFreeList(new_free);
+
+    // Create block
+    sf_block *alloc = setAllocBlock(block, adjSize);
+
+    // sf_show_heap();
+    return alloc;
         
-        // Remove from free list
-        char *top = (char *)block - top_size;
-        removeFromFreeList((sf_block *)top);
+}
+
+int getIndex(size_t size) {
+    // Index 0 holds exactly M, index i holds (2^(i-1) M, 2^i M]
+    // ceil(log2(size / M)) == bit width of (size - 1) minus log2(M)
+    if (size <= MIN_BLOCK_SIZE) {
+        return 0;
+    }
+
+    int index = (int)(sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long)(size - 1)) - MIN_BLOCK_SHIFT;
+    if (index > NUM_FREE_LISTS - 1) {
+        return NUM_FREE_LISTS - 1;
+    }
+
+    return index;
+}
+
+int getSubBin(int index, size_t size) {
+    // Class i in 1..8 spans (lo, 2 lo] with lo = 2^(i-1) M, split into sub_bins equal
+    // ranges; the single-size first class and the indexed top class have one sub-bin
+    if(index == 0 || index == NUM_FREE_LISTS - 1) {
+        return 0;
+    }
+
+    size_t lo = (size_t)MIN_BLOCK_SIZE << (index - 1);
+    return (int)((size - lo - 1) * sub_bins / lo);
+}
+
+sf_block *subBinFit(size_t adjSize) {
+    // O(1) good fit below the top class: the newest block of adjSize's own sub-bin if it
+    // is large enough, else the newest block of the next non-empty sub-bin, every block
+    // of which fits.  The class level and the sub-bin level each take one find-first-set.
+    int index = getIndex(adjSize);
+    if(index == NUM_FREE_LISTS - 1) {
+        return NULL;
+    }
+
+    int sub = getSubBin(index, adjSize);
+    sf_block *head = cur_arena->sub_bin_heads[index][sub];
+    if(head != NULL && (head->header & SIZE) >= adjSize) {
+        return head;
+    }
+
+    unsigned int subs = cur_arena->sub_bin_masks[index] & (~0u << (sub + 1));
+    if(subs != 0) {
+        return cur_arena->sub_bin_heads[index][__builtin_ctz(subs)];
+    }
+
+    unsigned int classes = cur_arena->sub_bin_classes & (~0u << (index + 1)) & ~(1u << (NUM_FREE_LISTS - 1));
+    if(classes != 0) {
+        int next = __builtin_ctz(classes);
+        return cur_arena->sub_bin_heads[next][__builtin_ctz(cur_arena->sub_bin_masks[next])];
+    }
+
+    return NULL;
+}
+
+int sf_set_sub_bins(int count) {
+    if((count != 1 && count != 2 && count != MAX_SUB_BINS) || main_arena.lists_initialized != -1) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    sub_bins = count;
+    return 0;
+}
+
+int getQuickIndex(size_t size) {
+    // Quick lists hold exact sizes M, M + 8, M + 16, ...
+    if(size < MIN_BLOCK_SIZE) {
+        return -1;
+    }
+
+    size_t index = (size - MIN_BLOCK_SIZE) / ALIGN_SIZE;
+    if(index >= NUM_QUICK_LISTS) {
+        return -1;
+    }
+
+    return (int)index;
+}
+
+void addToQuickList(sf_block *block, int index) {
+    // Inserting into a full list flushes it first, leaving it with just this block,
+    // unless the class is hot enough for an adaptive list to grow instead
+    if(cur_arena->quick_lists[index].length >= quickCapacity(index) && !adaptQuickCapacity(index)) {
+        flushQuickList(index);
+    }
+
+    // Block keeps its allocated and prev alloc bits so it is never coalesced
+    block->header |= IN_QUICK_LIST | THIS_BLOCK_ALLOCATED;
+    block->body.links.next = cur_arena->quick_lists[index].first;
+    cur_arena->quick_lists[index].first = block;
+    cur_arena->quick_lists[index].length += 1;
+}
+
+void flushQuickList(int index) {
+    // Return every block in the quick list to the main free lists as one coalesced batch
+    sf_block *chain = cur_arena->quick_lists[index].first;
+    cur_arena->quick_lists[index].first = NULL;
+    cur_arena->quick_lists[index].length = 0;
+    cur_arena->quick_flushes[index]++;
+
+    flushBlocks(chain, 0);
+}
+
+int quickCapacity(int index) {
+    if(quick_budget == 0) {
+        return QUICK_LIST_MAX;
+    }
+
+    return cur_arena->quick_capacity[index];
+}
+
+int adaptQuickCapacity(int index) {
+    // Called when a quick list is full.  Returns 1 if its capacity grew, so the
+    // new block fits without a flush, else 0 and the caller flushes the list.
+    if(quick_budget == 0) {
+        return 0;
+    }
+
+    int capacity = cur_arena->quick_capacity[index];
+    unsigned long hits = cur_arena->quick_window_hits[index];
+    size_t size = MIN_BLOCK_SIZE + index * ALIGN_SIZE;
+    cur_arena->quick_window_hits[index] = 0;
+
+    // Hot: a whole list was reused since it last filled, so a longer one would be too
+    if(hits >= (unsigned long)capacity) {
+        cur_arena->quick_cold_fills[index] = 0;
+        if(capacity >= QUICK_ADAPT_MAX) {
+            return 0;
+        }
+
+        int grown = (capacity * 2 > QUICK_ADAPT_MAX) ? QUICK_ADAPT_MAX : capacity * 2;
+        size_t extra = (grown - capacity) * size;
+        if(__atomic_add_fetch(&quick_reserved, extra, __ATOMIC_RELAXED) > quick_budget) {
+            __atomic_sub_fetch(&quick_reserved, extra, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        cur_arena->quick_capacity[index] = grown;
+        return 1;
+    }
+
+    // Cold: blocks keep getting flushed without ever being reused
+    if(hits == 0) {
+        cur_arena->quick_cold_fills[index]++;
+    }
+    else {
+        cur_arena->quick_cold_fills[index] = 0;
+    }
+
+    if(cur_arena->quick_cold_fills[index] >= QUICK_COLD_FILLS && capacity > 1) {
+        int shrunk = capacity / 2;
+        __atomic_sub_fetch(&quick_reserved, (capacity - shrunk) * size, __ATOMIC_RELAXED);
+        cur_arena->quick_capacity[index] = shrunk;
+        cur_arena->quick_cold_fills[index] = 0;
+    }
+
+    return 0;
+}
+
+size_t resetQuickCapacity(sf_arena *arena) {
+    // Puts every class of arena back at QUICK_LIST_MAX and returns the bytes that reserves
+    size_t reserved = 0;
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) {
+        arena->quick_capacity[i] = QUICK_LIST_MAX;
+        arena->quick_window_hits[i] = 0;
+        arena->quick_cold_fills[i] = 0;
+        reserved += QUICK_LIST_MAX * (MIN_BLOCK_SIZE + i * ALIGN_SIZE);
+    }
+
+    return reserved;
+}
+
+sf_block *sortByAddress(sf_block *chain) {
+    // Sorts a chain linked through links.next, lowest address first.  LIFO bins and
+    // batches freed in allocation order are usually already in one order or the
+    // other, which takes a single pass; anything else is merge sorted, since
+    // sf_free_batch passes chains of any length and order.
+    int ascending = 1, descending = 1;
+    for(sf_block *block = chain; block != NULL && block->body.links.next != NULL; block = block->body.links.next) {
+        if((char *)block < (char *)block->body.links.next) {
+            descending = 0;
+        }
+        else {
+            ascending = 0;
+        }
+    }
+
+    if(ascending) {
+        return chain;
+    }
+    if(!descending) {
+        return mergeByAddress(chain);
+    }
+
+    sf_block *sorted = NULL;
+    while(chain != NULL) {
+        sf_block *next = chain->body.links.next;
+        chain->body.links.next = sorted;
+        sorted = chain;
+        chain = next;
+    }
+
+    return sorted;
+}
+
+sf_block *mergeByAddress(sf_block *chain) {
+    // Merge sort of a chain linked through links.next, lowest address first
+    if(chain == NULL || chain->body.links.next == NULL) {
+        return chain;
+    }
+
+    // Split after the middle block and sort both halves
+    sf_block *middle = chain;
+    for(sf_block *fast = chain->body.links.next; fast != NULL && fast->body.links.next != NULL;
+        fast = fast->body.links.next->body.links.next) {
+        middle = middle->body.links.next;
+    }
+    sf_block *second = mergeByAddress(middle->body.links.next);
+    middle->body.links.next = NULL;
+    sf_block *first = mergeByAddress(chain);
+
+    sf_block *sorted = NULL;
+    sf_block **tail = &sorted;
+    while(first != NULL && second != NULL) {
+        sf_block **lower = (char *)first < (char *)second ? &first : &second;
+        *tail = *lower;
+        tail = &(*lower)->body.links.next;
+        *lower = (*lower)->body.links.next;
+    }
+    *tail = first != NULL ? first : second;
+
+    return sorted;
+}
+
+void flushBlocks(sf_block *chain, int lock) {
+    // Frees a chain of allocated blocks in one pass: sorted by address, each run of
+    // adjacent blocks becomes a single free block that is coalesced and inserted once.
+    // With lock set, the blocks may belong to several arenas and each one's lock is
+    // taken once per run; otherwise they all belong to cur_arena, whose lock is held.
+    sf_arena *locked = NULL;
+    chain = sortByAddress(chain);
+    while(chain != NULL) {
+        sf_block *run = chain;
+        size_t size = run->header & SIZE;
+        chain = chain->body.links.next;
+
+        // A run never crosses into another arena: every chunk starts with its own prologue
+        while(chain != NULL && (char *)run + size == (char *)chain) {
+            size += chain->header & SIZE;
+            chain = chain->body.links.next;
+        }
+
+        if(lock) {
+            sf_arena *arena = findArena(run);
+            if(arena != locked) {
+                if(locked != NULL) {
+                    pthread_mutex_unlock(&locked->lock);
+                }
+                pthread_mutex_lock(&arena->lock);
+                cur_arena = arena;
+                locked = arena;
+            }
+        }
+
+        // Only the run's first header survives; the rest are absorbed into its payload
+        run->body.links.prev = NULL;
+        run->header = size | (run->header & PREV_BLOCK_ALLOCATED) | THIS_BLOCK_ALLOCATED;
+        freeToMainList(run);
+    }
+
+    if(locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+sf_block *allocateChain(size_t adjSize, size_t count) {
+    // Allocates up to count blocks of adjSize from cur_arena, whose lock the caller holds,
+    // chained through links.next: first whatever the quick list of that size holds, then
+    // blocks carved from as few splits of larger free blocks as possible
+    sf_block *head = NULL;
+    sf_block **tail = &head;
+    sf_block *block;
+    while(count > 0 && (block = checkQuickList(adjSize)) != NULL) {
+        *tail = block;
+        tail = &block->body.links.next;
+        count--;
+    }
+
+    while(count > 0 && (*tail = carveBlocks(adjSize, count)) != NULL) {
+        while(*tail != NULL) {
+            tail = &(*tail)->body.links.next;
+            count--;
+        }
+    }
+
+    updatePeak();
+    return head;
+}
+
+sf_block *carveBlocks(size_t adjSize, size_t count) {
+    // Allocates up to count blocks of adjSize from cur_arena by splitting one larger
+    // free block, and returns them chained through links.next in address order.
+    // Asks for fewer blocks when neither a free block nor heap growth covers the batch.
+    sf_block *run = NULL;
+    while(count > 0 && (run = checkFreeList(adjSize * count, adjSize * count - 8)) == NULL) {
+        count /= 2;
+    }
+
+    if(run == NULL) {
+        return NULL;
+    }
+
+    // The first piece keeps the run's prev bit, the rest follow an allocated piece.
+    // The last piece absorbs any splinter the split left over.
+    size_t remaining = run->header & SIZE;
+    sf_block *block = run;
+    for(size_t i = 1; i < count; i++) {
+        sf_block *next = (sf_block *)((char *)block + adjSize);
+        setAllocBlock(block, adjSize);
+        block->body.links.next = next;
+
+        next->header = PREV_BLOCK_ALLOCATED;
+        remaining -= adjSize;
+        block = next;
+    }
+
+    setAllocBlock(block, remaining);
+    block->body.links.next = NULL;
+    return run;
+}
+
+sf_block *freeToMainList(sf_block *block) {
+    // Mark block free, coalesce it with its neighbours and add it to the main free list
+    LATENCY_PATH(LATENCY_LIST);
+    if((block->header & PREV_BLOCK_ALLOCATED) == 0) {
+        block = setFreeBlock(block, block->header & SIZE, 0);
+    }
+    else {
+        block = setFreeBlock(block, block->header & SIZE, 1);
+    }
+
+    block = coalesce(block);
+
+    // Set the bottom block prev bit to 0
+    // Atomic: an allocated neighbour's header may be read by a thread cache without the lock
+    sf_block *bottom = (sf_block *)((char *)block + (block->header & SIZE));
+    __atomic_fetch_and(&bottom->header, ~(sf_header)PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED);
+
+    // A free that grows the wilderness past the threshold gives its tail pages back
+    if(trim_threshold != 0 && block == cur_arena->wilderness) {
+        trimArena(trim_pad, trim_threshold);
+    }
+
+    return block;
+}
+
+void addToFreeList(sf_block *block) {
+    // Each class list is its sub-bin segments in order of size, newest block first in
+    // each, followed by the wilderness if it belongs to the class
+    size_t size = block->header & SIZE;
+    int index = getIndex(size);
+    sf_block *sentinel = &cur_arena->free_list_heads[index];
+    sf_block *wilderness = cur_arena->wilderness;
+    sf_block *before = sentinel;
+
+    // A free block ending at the epilogue is the wilderness, kept out of the segments
+    if((sf_block *)((char *)block + size) == cur_arena->epilogue) {
+        cur_arena->wilderness = block;
+    }
+    else {
+        int sub = getSubBin(index, size);
+        before = cur_arena->sub_bin_heads[index][sub];
+
+        // First block of its segment: goes before the next non-empty one, or the wilderness
+        if(before == NULL) {
+            unsigned int later = cur_arena->sub_bin_masks[index] & (~0u << sub);
+            if(later != 0) {
+                before = cur_arena->sub_bin_heads[index][__builtin_ctz(later)];
+            }
+            else if(wilderness != NULL && getIndex(wilderness->header & SIZE) == index) {
+                before = wilderness;
+            }
+            else {
+                before = sentinel;
+            }
+        }
+
+        cur_arena->sub_bin_heads[index][sub] = block;
+        cur_arena->sub_bin_masks[index] |= 1u << sub;
+        cur_arena->sub_bin_classes |= 1u << index;
+
+        if(index < NUM_FREE_LISTS - 1) {
+            countFreeSize(size, 1);
+        }
+        else if(size > cur_arena->large_free_max) {
+            cur_arena->large_free_max = size;
+        }
+    }
+
+    block->body.links.next = before;
+    block->body.links.prev = before->body.links.prev;
+    before->body.links.prev->body.links.next = block;
+    before->body.links.prev = block;
+
+    cur_arena->nonempty_free_lists |= 1u << index;
+    cur_arena->free_bytes += size;
+    if(index == NUM_FREE_LISTS - 1) {
+        cur_arena->large_root = treeInsert(cur_arena->large_root, block);
+    }
+}
+
+void removeFromFreeList(sf_block *block) {
+    size_t size = block->header & SIZE;
+    int index = getIndex(size);
+    cur_arena->free_bytes -= size;
+    if(index == NUM_FREE_LISTS - 1) {
+        cur_arena->large_root = treeRemove(cur_arena->large_root, block);
+    }
+
+    // The segment head passes to the next block if that is still in the segment
+    int sub = getSubBin(index, size);
+    if(cur_arena->sub_bin_heads[index][sub] == block) {
+        sf_block *next = block->body.links.next;
+        if(next != &cur_arena->free_list_heads[index] && next != cur_arena->wilderness
+            && getSubBin(index, next->header & SIZE) == sub) {
+            cur_arena->sub_bin_heads[index][sub] = next;
+        }
+        else {
+            cur_arena->sub_bin_heads[index][sub] = NULL;
+            cur_arena->sub_bin_masks[index] &= ~(1u << sub);
+            if(cur_arena->sub_bin_masks[index] == 0) {
+                cur_arena->sub_bin_classes &= ~(1u << index);
+            }
+        }
+    }
+
+    block->body.links.prev->body.links.next = block->body.links.next;
+    block->body.links.next->body.links.prev = block->body.links.prev;
+
+    // Neighbours are the same node only when the sentinel is all that is left
+    if(block->body.links.prev == block->body.links.next) {
+        cur_arena->nonempty_free_lists &= ~(1u << index);
+    }
+
+    if(block == cur_arena->wilderness) {
+        cur_arena->wilderness = NULL;
+    }
+    else if(index < NUM_FREE_LISTS - 1) {
+        countFreeSize(size, -1);
+    }
+    else if(size == cur_arena->large_free_max) {
+        cur_arena->large_free_max = largestTopBlock();
+    }
+
+    block->body.links.next = NULL;
+    block->body.links.prev = NULL;
+}
+
+void countFreeSize(size_t size, int delta) {
+    // Adjusts the count of free blocks of a size below the top class
+    size_t i = size / ALIGN_SIZE - 1;
+    unsigned int word = i / 64;
+    unsigned long bit = 1ul << (i % 64);
+    cur_arena->small_free_counts[i] += delta;
+    if(cur_arena->small_free_counts[i] != 0) {
+        cur_arena->small_free_sizes[word] |= bit;
+        cur_arena->small_free_words |= 1u << word;
+    }
+    else {
+        cur_arena->small_free_sizes[word] &= ~bit;
+        if(cur_arena->small_free_sizes[word] == 0) {
+            cur_arena->small_free_words &= ~(1u << word);
+        }
+    }
+}
+
+size_t largestTopBlock() {
+    // Rightmost node of the top class index other than the wilderness, which is
+    // passed over to its left subtree when it has nothing to its right
+    size_t largest = 0;
+    sf_block *node = cur_arena->large_root;
+    while(node != NULL) {
+        if(node == cur_arena->wilderness && treeChildren(node)[1] == NULL) {
+            node = treeChildren(node)[0];
+            continue;
+        }
+        if(node != cur_arena->wilderness) {
+            largest = node->header & SIZE;
+        }
+        node = treeChildren(node)[1];
+    }
+
+    return largest;
+}
+
+// Blocks in the top free list class are also kept in a treap ordered by (size, address),
+// so the smallest block that fits is found in expected O(log n).  A block's tree links
+// follow its list links; the priority is a hash of its address, so it takes no space.
+
+sf_block **treeChildren(sf_block *block) {
+    return (sf_block **)((char *)block + 8 + sizeof(block->body.links));
+}
+
+int treeKeyLess(sf_block *a, size_t size, sf_block *address) {
+    // Whether block a orders before the key (size, address)
+    size_t a_size = a->header & SIZE;
+    return a_size < size || (a_size == size && (char *)a < (char *)address);
+}
+
+uintptr_t treePriority(sf_block *block) {
+    return ((uintptr_t)block >> 3) * 0x9E3779B97F4A7C15u;
+}
+
+sf_block *treeRotate(sf_block *root, int dir) {
+    // Lifts root's child on side dir above it and returns the new root
+    sf_block *child = treeChildren(root)[dir];
+    treeChildren(root)[dir] = treeChildren(child)[!dir];
+    treeChildren(child)[!dir] = root;
+    return child;
+}
+
+sf_block *treeInsert(sf_block *root, sf_block *block) {
+    if(root == NULL) {
+        treeChildren(block)[0] = NULL;
+        treeChildren(block)[1] = NULL;
+        return block;
+    }
+
+    int dir = treeKeyLess(root, block->header & SIZE, block);
+    treeChildren(root)[dir] = treeInsert(treeChildren(root)[dir], block);
+    if(treePriority(treeChildren(root)[dir]) > treePriority(root)) {
+        root = treeRotate(root, dir);
+    }
+
+    return root;
+}
+
+sf_block *treeRemove(sf_block *root, sf_block *block) {
+    if(root == NULL) {
+        return NULL;
+    }
+
+    sf_block **children = treeChildren(root);
+    if(root != block) {
+        int dir = treeKeyLess(root, block->header & SIZE, block);
+        children[dir] = treeRemove(children[dir], block);
+        return root;
+    }
+
+    // Rotate the block down below its higher priority child until it is a leaf
+    if(children[0] == NULL) {
+        return children[1];
+    }
+    if(children[1] == NULL) {
+        return children[0];
+    }
+
+    int dir = treePriority(children[1]) > treePriority(children[0]);
+    sf_block *top = treeRotate(root, dir);
+    treeChildren(top)[!dir] = treeRemove(root, block);
+    return top;
+}
+
+sf_block *treeLowerBound(sf_block *root, size_t size, sf_block *address) {
+    // Smallest block that does not order before (size, address), or NULL
+    sf_block *bound = NULL;
+    while(root != NULL) {
+        if(treeKeyLess(root, size, address)) {
+            root = treeChildren(root)[1];
+        }
+        else {
+            bound = root;
+            root = treeChildren(root)[0];
+        }
+    }
+
+    return bound;
+}
+
+sf_block *treeBestFit(size_t adjSize) {
+    // Smallest top class block of at least adjSize other than the wilderness
+    sf_block *best = treeLowerBound(cur_arena->large_root, adjSize, NULL);
+    if(best != NULL && best == cur_arena->wilderness) {
+        best = treeLowerBound(cur_arena->large_root, best->header & SIZE, (sf_block *)((char *)best + 1));
+    }
+
+    return best;
+}
+
+sf_block *coalesce(sf_block *block) {
+    // Block is a  block that is free/ allocated block just freed
+    // Removes the free adjacent blocks from the free list and adds the nwe coalesced block
+    // Sets block to free and returns a coalesced free block
+
+    char *bottom_header = (char *)block + (block->header & SIZE);
+    sf_block *bottom = (sf_block *)bottom_header;
+
+    // Top and bottom block are free
+    if((block->header & PREV_BLOCK_ALLOCATED) == 0 && (bottom->header & THIS_BLOCK_ALLOCATED) == 0) {
+        // Get top 
+        char *footer = (char *)block - 8;
+        sf_footer *actual_footer = (sf_footer *) footer;
+
+        size_t top_size = *actual_footer & SIZE;
+        size_t current_size = block->header & SIZE;
+        size_t bottom_size = bottom->header & SIZE;
+
+        // Remove from free list
+        char *top = (char *)block - top_size;
+        removeFromFreeList((sf_block *)top);
+        removeFromFreeList(bottom);
+        
+
+        // Set new coalesce block
+        sf_block *free;
+        if((*actual_footer & PREV_BLOCK_ALLOCATED) == 0) {
+            free = setFreeBlock((sf_block *)top, top_size + current_size + bottom_size, 0);
+        }
+        else {
+            free = setFreeBlock((sf_block *)top, top_size + current_size + bottom_size, 1);
+        }
+         
+        cur_arena->coalesces[getIndex(free->header & SIZE)]++;
+        addToFreeList(free);
+        // sf_show_heap();
+        return free;
+    }
+
+    // Top block is free and bottom is allocated
+    else if((block->header & PREV_BLOCK_ALLOCATED) == 0 && (bottom->header & THIS_BLOCK_ALLOCATED)) {
+        // Get top 
+        char *footer = (char *)block - 8;
+        sf_footer *actual_footer = (sf_footer *) footer;
+        size_t top_size = *actual_footer & SIZE;
+        size_t current_size = block->header & SIZE;
+        
+        // Remove from free list
+        char *top = (char *)block - top_size;
+        removeFromFreeList((sf_block *)top);
+
+        // Set new coalesce block
+         sf_block *free;
+        if((*footer & PREV_BLOCK_ALLOCATED) == 0) {
+            free = setFreeBlock((sf_block *)top, top_size + current_size, 0);
+        }
+        else {
+            free = setFreeBlock((sf_block *)top, top_size + current_size, 1);
+        }
+        
+        cur_arena->coalesces[getIndex(free->header & SIZE)]++;
+        addToFreeList(free);
+        // sf_show_heap();
+        return free;
+    }
+
+
+    // Top is allocated and bottom is free
+    else if((block->header & PREV_BLOCK_ALLOCATED) != 0 && (bottom->header & THIS_BLOCK_ALLOCATED) == 0) {
+        size_t current_size = block->header & SIZE;
+        size_t bottom_size = bottom->header & SIZE;
+
+        removeFromFreeList(bottom);
+        // printf("BOTTOM SIZE: %ld\n", bottom_size);
+        sf_block *free = setFreeBlock((sf_block *)block, current_size + bottom_size, 1);
+        cur_arena->coalesces[getIndex(free->header & SIZE)]++;
+        addToFreeList(free);
+        return free;
+    }
+
+    // Top and bottom are allocated
+    else {
+        sf_block *free = setFreeBlock((sf_block *)block, block->header & SIZE, 1);
+        addToFreeList(free);
+        return free;
+
+    }
+}
+
+
+int checkBlockHeader(sf_block *block) {
+    // Returns 0 if block's own header describes an allocated block inside the heap, -1 otherwise
+    // Read once: a thread cache calls this without holding the arena lock
+    sf_header header = __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+
+    // Block size is < 32 or size is not a multiple of 8
+    if((header & SIZE) < 32 || (header & SIZE) % 8 != 0) {
+        return -1;
+    }
+
+    // Header is before the start of the heap or footer of the block is after the end of the last block of the heap
+    sf_footer *footer = (sf_footer *)((char *)block + (header & SIZE) - 8);
+    if(block < (sf_block *)heapStart() || footer > (sf_footer *)heapEnd()) {
+        return -1;
+    }
+
+    // Block bit is not allocated or quicklist bit is allocated 
+    if((header & THIS_BLOCK_ALLOCATED) == 0 || (header & IN_QUICK_LIST) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int checkBlock(void *pp) {
+    // Returns 0 if pp is a payload pointer of an allocated block, -1 otherwise
+
+    // Pointer is null or not 8 byte aligned
+    if(pp == NULL || (uintptr_t)pp % 8 != 0) {
+        return -1;
+    }
+
+    char *header = (char *)pp - 8;
+    sf_block *block = (sf_block *)header;
+
+    if(checkBlockHeader(block) != 0) {
+        return -1;
+    }
+
+    // Prev alloc bit is 0 but the prev block is allocated
+    if((block->header & PREV_BLOCK_ALLOCATED) == 0) {
+        sf_footer *prev_footer = (sf_footer *)((char *)block - 8);
+
+        if((*prev_footer & THIS_BLOCK_ALLOCATED) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void freeBlock(sf_block *block) {
+    // Frees an allocated block into cur_arena, whose lock the caller holds
+
+    // Cache line blocks are kept for sf_malloc_cacheline
+    if(cacheline_used) {
+        int index = getCachelineIndex(block, block->header & SIZE);
+        if(index >= 0) {
+            addToCachelineBin(block, index);
+            return;
+        }
+    }
+
+    // Small blocks go straight onto the quick list for their exact size
+    int index = getQuickIndex(block->header & SIZE);
+    if(index >= 0) {
+        addToQuickList(block, index);
+        return;
+    }
+
+    // Add to the main free list
+    freeToMainList(block);
+}
+
+void freeSizedBlock(sf_block *block, size_t adjSize) {
+    // freeBlock for sf_free_sized: adjSize, from the caller's request, picks the quick
+    // list instead of the header.  A block that took a splinter with it is up to 24
+    // bytes larger and serves requests of adjSize from that list; blocks going to the
+    // main lists are coalesced first, so their class comes from the merged size.
+    int index = getQuickIndex(adjSize);
+    if(index >= 0) {
+        addToQuickList(block, index);
+        return;
+    }
+
+    freeToMainList(block);
+}
+
+size_t sf_malloc_batch(size_t size, size_t count, void **out) {
+    if(trace_file != NULL && traceEnter()) {
+        size_t allocated = sf_malloc_batch(size, count, out);
+        for(size_t i = 0; i < allocated; i++) {
+            traceRecord(SF_TRACE_MALLOC, NULL, out[i], size, 0);
+        }
+        traceLeave();
+        return allocated;
+    }
+
+    if(size == 0 || count == 0)
+        return 0;
+
+    size_t total_size = size + 8;
+    if(total_size % 8 != 0) {
+        total_size = total_size + 8 - (total_size % 8);
+    }
+    if(total_size < 32) {
+        total_size = 32;
+    }
+
+    if(count > SIZE_MAX / total_size) {
+        sf_errno = ENOMEM;
+        return 0;
+    }
+
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    sf_block *chain = allocateChain(total_size, count);
+    pthread_mutex_unlock(&arena->lock);
+
+    size_t allocated = 0;
+    for(; chain != NULL; chain = chain->body.links.next) {
+        out[allocated++] = (char *)chain + 8;
+        countRequest(size, total_size, chain->header & SIZE);
+    }
+
+    // A secondary arena that cannot get another chunk falls back to the main arena
+    if(allocated < count && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        cur_arena = &main_arena;
+        chain = allocateChain(total_size, count - allocated);
+        pthread_mutex_unlock(&main_arena.lock);
+
+        for(; chain != NULL; chain = chain->body.links.next) {
+            out[allocated++] = (char *)chain + 8;
+            countRequest(size, total_size, chain->header & SIZE);
+        }
+    }
+
+    if(allocated < count) {
+        sf_errno = ENOMEM;
+    }
+
+    return allocated;
+}
+
+void sf_free_batch(void **pps, size_t count) {
+    if(trace_file != NULL && traceEnter()) {
+        sf_free_batch(pps, count);
+        for(size_t i = 0; i < count; i++) {
+            traceRecord(SF_TRACE_FREE, pps[i], NULL, 0, 0);
+        }
+        traceLeave();
+        return;
+    }
+
+    if(__atomic_load_n(&sample_live, __ATOMIC_RELAXED) != 0) {
+        for(size_t i = 0; i < count; i++) {
+            sampleFree(pps[i], NULL, NULL);
+        }
+    }
+
+    // Validates every pointer under its arena's lock, marking each block as it goes so
+    // a pointer given twice fails validation, then frees them all in one sorted pass
+    sf_arena *locked = NULL;
+    sf_block *chain = NULL;
+    for(size_t i = 0; i < count; i++) {
+        void *pp = pps[i];
+        if(pp == NULL || (uintptr_t)pp % 8 != 0) {
+            abort();
+        }
+
+        sf_block *block = (sf_block *)((char *)pp - 8);
+        if(mmap_used && isMappedBlock(block)) {
+            unmapBlock(block);
+            continue;
+        }
+
+        sf_arena *arena = findArena(block);
+        if(arena != locked) {
+            if(locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            cur_arena = arena;
+            locked = arena;
+        }
+
+        if(checkBlock(pp) != 0) {
+            abort();
+        }
+
+        block->header |= IN_QUICK_LIST;
+        block->body.links.next = chain;
+        chain = block;
+    }
+
+    if(locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+
+    flushBlocks(chain, 1);
+}
+
+void sf_free(void *pp) {
+    if(trace_file != NULL && traceEnter()) {
+        sf_free(pp);
+        traceRecord(SF_TRACE_FREE, pp, NULL, 0, 0);
+        traceLeave();
+        return;
+    }
+
+#ifdef LATENCY_HISTOGRAMS
+    if(latencyEnter()) {
+        sf_free(pp);
+        latencyLeave(LATENCY_FREE);
+        return;
+    }
+#endif
+
+    // A sampled block leaves the profile before another thread can be given its address
+    if(__atomic_load_n(&sample_live, __ATOMIC_RELAXED) != 0) {
+        sampleFree(pp, NULL, NULL);
+    }
+
+    // Pointer is null or not 8 byte aligned
+    if(pp == NULL || (uintptr_t)pp % 8 != 0) {
+        abort();
+    }
+
+    sf_block *block = (sf_block *)((char *)pp - 8);
+    if(mmap_used && isMappedBlock(block)) {
+        unmapBlock(block);
+        return;
+    }
+
+    if(tcache_capacity > 0 && tcacheFree(block)) {
+        return;
+    }
+
+    // Blocks are always returned to the arena that owns them
+    sf_arena *arena = findArena(block);
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+
+    if(checkBlock(pp) != 0) {
+        abort();
+    }
+
+    freeBlock(block);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void sf_free_sized(void *pp, size_t size) {
+    if(trace_file != NULL && traceEnter()) {
+        sf_free_sized(pp, size);
+        traceRecord(SF_TRACE_FREE, pp, NULL, 0, 0);
+        traceLeave();
+        return;
+    }
+
+    if(__atomic_load_n(&sample_live, __ATOMIC_RELAXED) != 0) {
+        sampleFree(pp, NULL, NULL);
+    }
+
+    size_t total_size = size + 8;
+    if(total_size % 8 != 0) {
+        total_size = total_size + 8 - (total_size % 8);
+    }
+    if(total_size < 32) {
+        total_size = 32;
+    }
+
+#ifdef DEBUG
+    // Everything sf_free checks, plus the size: a block is at most a splinter larger
+    // than its request, unless it is a cache line block or has a mapping of its own
+    if(pp == NULL || (uintptr_t)pp % 8 != 0) {
+        abort();
+    }
+
+    sf_block *block = (sf_block *)((char *)pp - 8);
+    size_t block_size = __atomic_load_n(&block->header, __ATOMIC_RELAXED) & SIZE;
+    size_t lines = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    int rounded = block_size == lines + 8 || (mmap_used && isMappedBlock(block));
+    if(block_size < total_size || (block_size - total_size >= MIN_BLOCK_SIZE && !rounded)) {
+        abort();
+    }
+
+    sf_free(pp);
+#else
+    // Trusted: no validation, and the size picks the thread cache bin or quick list
+    // without reading the header.  Cache line blocks cannot be told apart by request
+    // size, so once sf_malloc_cacheline has been used the header decides as in sf_free.
+    sf_block *block = (sf_block *)((char *)pp - 8);
+    if(mmap_used && isMappedBlock(block)) {
+        unmapBlock(block);
+        return;
+    }
+
+    int cachelines = __atomic_load_n(&cacheline_used, __ATOMIC_RELAXED);
+    int index = getQuickIndex(total_size);
+    if(tcache_capacity > 0 && index >= 0 && !cachelines) {
+        tcachePush(block, index);
+        return;
+    }
+
+    sf_arena *arena = findArena(block);
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    if(cachelines) {
+        freeBlock(block);
+    }
+    else {
+        freeSizedBlock(block, total_size);
+    }
+    pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+void *sf_realloc(void *pp, size_t rsize) {
+    if(trace_file != NULL && traceEnter()) {
+        void *moved = sf_realloc(pp, rsize);
+        traceRecord(SF_TRACE_REALLOC, pp, moved, rsize, 0);
+        traceLeave();
+        return moved;
+    }
+
+#ifdef LATENCY_HISTOGRAMS
+    if(latencyEnter()) {
+        void *moved = sf_realloc(pp, rsize);
+        latencyLeave(LATENCY_REALLOC);
+        return moved;
+    }
+#endif
+
+    // To the sampler a realloc is a new request of rsize bytes: a sampled block leaves
+    // the profile, and the block the realloc leaves is sampled like any other.  A block
+    // a failed realloc leaves alone goes back under the call site it was sampled at.
+    // The allocation a move makes is not a request of its own.
+    if(!sample_nested) {
+        unsigned long site = 0;
+        size_t weight = 0;
+        size_t sampled = __atomic_load_n(&sample_live, __ATOMIC_RELAXED) != 0 ? sampleFree(pp, &site, &weight) : 0;
+        int due = (sample_countdown -= (long)rsize) < 0 && sampleEnter();
+        long countdown = sample_countdown;
+        sample_nested = 1;
+        void *moved = sf_realloc(pp, rsize);
+        sample_countdown = countdown;
+        if(moved == NULL && rsize != 0) {
+            sampleRestore(sampled != 0 ? pp : NULL, site, sampled, weight);
+        } else {
+            sampleLeave(due ? moved : NULL, rsize, 0);
+        }
+        return moved;
+    }
+
+     // Pointer is null or not 8 byte aligned
+    if(pp == NULL || (uintptr_t)pp % 8 != 0) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+
+    char *header = (char *)pp - 8;
+    sf_block *block = (sf_block *)header;
+
+    // A mapped block is remapped, which may move it without copying; one that falls
+    // below the threshold moves back into the heap
+    if(mmap_used && isMappedBlock(block)) {
+        if(rsize == 0) {
+            unmapBlock(block);
+            return NULL;
+        }
+
+        size_t mapped_size = rsize + 8;
+        if(mapped_size % 8 != 0) {
+            mapped_size = mapped_size + 8 - (mapped_size % 8);
+        }
+
+        if(mmap_threshold != 0 && mapped_size >= mmap_threshold) {
+            sf_block *remapped = remapBlock(block, mapped_size);
+            if(remapped == NULL) {
+                sf_errno = ENOMEM;
+                return NULL;
+            }
+            countRequest(rsize, mapped_size, mapped_size);
+            return (char *)remapped + 8;
+        }
+
+        void *pointer = sf_malloc(rsize);
+        if(pointer == NULL) {
+            return NULL;
+        }
+        size_t payload = (block->header & SIZE) - 8;
+        memcpy(pointer, pp, rsize < payload ? rsize : payload);
+        unmapBlock(block);
+        return pointer;
+    }
+
+    // Resize within the arena that owns the block
+    sf_arena *arena = findArena(block);
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+
+    if(checkBlock(pp) != 0) {
+        pthread_mutex_unlock(&arena->lock);
+        sf_errno = EINVAL;
+        return NULL;
+    }
+
+    // Same as freeing the block
+    if(rsize == 0) {
+        freeBlock(block);
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+
+    // Calculate block size including needed padding
+    size_t total_size = rsize + 8;
+    if(total_size % 8 != 0) {
+        total_size = total_size + 8 - (total_size % 8);
+    }
+    if(total_size < 32) {
+        total_size = 32;
+    }
+
+    size_t size = block->header & SIZE;
+
+    // Reallocating to larger size
+    if(size < total_size) {
+        // Absorb the free block or wilderness that follows, else copy as a last resort.
+        // A block growing past the mmap threshold moves out of the heap instead.
+        int leaves_heap = mmap_threshold != 0 && total_size >= mmap_threshold;
+        if(!leaves_heap && growInPlace(block, total_size)) {
+            updatePeak();
+            pthread_mutex_unlock(&arena->lock);
+            countRequest(rsize, total_size, block->header & SIZE);
+            __atomic_add_fetch(&realloc_counters.in_place, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&realloc_counters.bytes_not_copied, size - 8, __ATOMIC_RELAXED);
+            return pp;
+        }
+
+        // Block stays allocated, so it is safe to move it without holding the lock
+        pthread_mutex_unlock(&arena->lock);
+        void *pointer = sf_malloc(rsize);
+
+        if(pointer == NULL) {
+            return NULL;
+        }
+
+        memcpy(pointer, pp, size - 8);
+        __atomic_add_fetch(&realloc_counters.moved, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&realloc_counters.bytes_copied, size - 8, __ATOMIC_RELAXED);
+
+        sf_free(pp);
+        return pointer;
+    }
+
+    // Reallocating to smaller size
+    // Case 1: Splitting results in splinter, or the size is unchanged
+    if(size - total_size < 32) {
+        pthread_mutex_unlock(&arena->lock);
+        countRequest(rsize, total_size, size);
+        return pp;
+    }
+
+    // Case 2: Split the blocks, freeing the remainder as its own block
+    sf_block *new_free = (sf_block *)((char *)block + total_size);
+    new_free->header = (size - total_size) | PREV_BLOCK_ALLOCATED;
+    setAllocBlock(block, total_size);
+
+    freeToMainList(new_free);
+    pthread_mutex_unlock(&arena->lock);
+    countRequest(rsize, total_size, total_size);
+    return pp;
+}
+
+int growInPlace(sf_block *block, size_t adjSize) {
+    // Grows the allocated block to adjSize without moving it, by absorbing the free
+    // block after it and splitting off any leftover.  A main arena block that ends at
+    // the wilderness or the epilogue grows the heap first if it has to.
+    // Returns 1 on success, 0 if the block must be moved instead.
+    LATENCY_PATH(LATENCY_LIST);
+    size_t size = block->header & SIZE;
+    sf_block *next = (sf_block *)((char *)block + size);
+    size_t available = size;
+    if((next->header & THIS_BLOCK_ALLOCATED) == 0) {
+        available += next->header & SIZE;
+    }
+
+    int at_top = (next == cur_arena->wilderness || next == cur_arena->epilogue);
+    if(available < adjSize && at_top && cur_arena == &main_arena) {
+        size_t missing = adjSize - available;
+        getMemory((missing + PAGE_SZ - 1) / PAGE_SZ);
+
+        // The old epilogue, if that was next, is now the header of the wilderness
+        available = size;
+        if((next->header & THIS_BLOCK_ALLOCATED) == 0) {
+            available += next->header & SIZE;
+        }
+    }
+
+    if(available < adjSize) {
+        return 0;
+    }
+
+    removeFromFreeList(next);
+
+    // Leftover too small to split: take the whole thing
+    if(available - adjSize < 32) {
+        setAllocBlock(block, available);
+
+        // Atomic: an allocated neighbour's header may be read by a thread cache without the lock
+        sf_block *bottom = (sf_block *)((char *)block + available);
+        __atomic_fetch_or(&bottom->header, PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    setAllocBlock(block, adjSize);
+    sf_block *rest = setFreeBlock((sf_block *)((char *)block + adjSize), available - adjSize, 1);
+    addToFreeList(rest);
+    return 1;
+}
+
+void sf_realloc_stats(sf_realloc_counters *counters) {
+    counters->in_place = __atomic_load_n(&realloc_counters.in_place, __ATOMIC_RELAXED);
+    counters->moved = __atomic_load_n(&realloc_counters.moved, __ATOMIC_RELAXED);
+    counters->bytes_copied = __atomic_load_n(&realloc_counters.bytes_copied, __ATOMIC_RELAXED);
+    counters->bytes_not_copied = __atomic_load_n(&realloc_counters.bytes_not_copied, __ATOMIC_RELAXED);
+}
+
+void *sf_memalign(size_t size, size_t align) {
+    if(trace_file != NULL && traceEnter()) {
+        void *pp = sf_memalign(size, align);
+        traceRecord(SF_TRACE_MEMALIGN, NULL, pp, size, align);
+        traceLeave();
+        return pp;
+    }
+
+#ifdef LATENCY_HISTOGRAMS
+    if(latencyEnter()) {
+        void *pp = sf_memalign(size, align);
+        latencyLeave(LATENCY_MEMALIGN);
+        return pp;
+    }
+#endif
+
+    if((sample_countdown -= (long)size) < 0 && sampleEnter()) {
+        long countdown = sample_countdown;
+        void *pp = sf_memalign(size, align);
+        sample_countdown = countdown;
+        sampleLeave(pp, size, 0);
+        return pp;
+    }
+
+    if ((align & (align - 1)) != 0 || align < 8) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+
+    if(size == 0)
+        return NULL;
+
+    size_t total_size = size + 8;
+    if(total_size % 8 != 0) {
+        total_size = total_size + 8 - (total_size % 8);
+    }
+    if(total_size < 32) {
+        total_size = 32;
+    }
+
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    sf_block *alloc_block = allocateAligned(total_size, align);
+    pthread_mutex_unlock(&arena->lock);
+
+    // A secondary arena that cannot get another chunk falls back to the main arena
+    if(alloc_block == NULL && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        cur_arena = &main_arena;
+        alloc_block = allocateAligned(total_size, align);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+
+    // Allocation not successfull
+    if(alloc_block == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    countRequest(size, total_size, alloc_block->header & SIZE);
+    return (char *)alloc_block + 8;
+}
+
+sf_block *allocateAligned(size_t adjSize, size_t align) {
+    // Allocates a block of adjSize bytes whose payload is aligned to align from
+    // cur_arena, whose lock the caller holds
+
+    LATENCY_PATH(LATENCY_LIST);
+
+    // Fast path: first free block that already holds an aligned payload, or whose
+    // unaligned front is large enough to go back on the free lists as a block.  Only
+    // the first ALIGNED_PROBES blocks of the classes from adjSize's up are tried, so
+    // the search does not grow with the number of free blocks.
+    unsigned int candidates = cur_arena->nonempty_free_lists & (~0u << getIndex(adjSize));
+    int probes = ALIGNED_PROBES;
+    while (candidates != 0 && probes > 0) {
+        int index = __builtin_ctz(candidates);
+        sf_block *sentinel = &cur_arena->free_list_heads[index];
+        for(sf_block *current = sentinel->body.links.next; current != sentinel && probes > 0;
+            current = current->body.links.next) {
+            probes--;
+            size_t lead = alignedLead(current, align);
+            if(current == cur_arena->wilderness || lead + adjSize > (current->header & SIZE)) {
+                continue;
+            }
+
+            // Take the whole block, then hand back the front and back
+            removeFromFreeList(current);
+            sf_block *block = setAllocBlock(current, current->header & SIZE);
+            sf_block *bottom = (sf_block *)((char *)block + (block->header & SIZE));
+            __atomic_fetch_or(&bottom->header, PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED);
+            block = carveAligned(block, lead, adjSize);
+            updatePeak();
+            return block;
+        }
+
+        candidates &= candidates - 1;
+    }
+
+    // Over-allocate so an aligned payload with a block-sized front always fits
+    sf_block *block = checkFreeList(adjSize + align + MIN_BLOCK_SIZE, adjSize - 8);
+    if(block == NULL) {
+        return NULL;
+    }
+
+    block = carveAligned(block, alignedLead(block, align), adjSize);
+    updatePeak();
+    return block;
+}
+
+void *sf_calloc(size_t nmemb, size_t size) {
+    if(trace_file != NULL && traceEnter()) {
+        void *pp = sf_calloc(nmemb, size);
+        traceRecord(SF_TRACE_CALLOC, NULL, pp, nmemb * size, 0);
+        traceLeave();
+        return pp;
+    }
+
+    if(nmemb == 0 || size == 0)
+        return NULL;
+
+    if(nmemb > SIZE_MAX / size) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size = nmemb * size;
+
+    if((sample_countdown -= (long)size) < 0 && sampleEnter()) {
+        long countdown = sample_countdown;
+        void *pp = sf_calloc(1, size);
+        sample_countdown = countdown;
+        sampleLeave(pp, size, 0);
+        return pp;
+    }
+
+    size_t total_size = size + 8;
+    if(total_size % 8 != 0) {
+        total_size = total_size + 8 - (total_size % 8);
+    }
+    if(total_size < 32) {
+        total_size = 32;
+    }
+
+    // Fresh mappings are already zero
+    if(mmap_threshold != 0 && total_size >= mmap_threshold) {
+        sf_block *mapped = mapBlock(total_size);
+        if(mapped == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        countRequest(size, total_size, total_size);
+        return (char *)mapped + 8;
+    }
+
+    // A cached block sits below the mark, so it is cleared in full
+    if(tcache_capacity > 0) {
+        sf_block *cached = tcacheAllocate(total_size);
+        if(cached != NULL) {
+            clearPayload(cached, NULL);
+            countRequest(size, total_size, cached->header & SIZE);
+            return (char *)cached + 8;
+        }
+    }
+
+    // The mark is read under the same lock as the allocation: only a holder of the
+    // main arena lock can move it, and a secondary arena's blocks all lie below it
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    char *clean = zero_mark;
+    sf_block *alloc_block = allocateBlock(total_size, size);
+    pthread_mutex_unlock(&arena->lock);
+
+    // A secondary arena that cannot get another chunk falls back to the main arena
+    if(alloc_block == NULL && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        cur_arena = &main_arena;
+        clean = zero_mark;
+        alloc_block = allocateBlock(total_size, size);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+
+    if(alloc_block == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    // Pages that may hold old data are cleared as they are handed out, not as they
+    // join the heap.  Before the first allocation a zeroed heap is clean throughout.
+    if(!page_provider.zeroed) {
+        clean = NULL;
+    }
+    else if(clean == NULL) {
+        clean = (char *)alloc_block;
+    }
+
+    clearPayload(alloc_block, clean);
+    countRequest(size, total_size, alloc_block->header & SIZE);
+    return (char *)alloc_block + 8;
+}
+
+void clearPayload(sf_block *block, char *clean) {
+    // Zeroes the payload of block, skipping what lies above the high-water mark clean
+    // (NULL if nothing is known to be clean) apart from the wilderness words there
+    char *payload = (char *)block + 8;
+    char *end = (char *)block + (block->header & SIZE);
+
+    // A wilderness starting at or below the mark keeps its header, list links and tree
+    // links within 40 bytes of it, and its footer lands on the last word of a block that
+    // took all of it
+    char *dirty_end = (clean == NULL) ? end : clean + 40;
+    if(dirty_end >= end) {
+        memset(payload, 0, end - payload);
+        return;
+    }
+
+    if(dirty_end > payload) {
+        memset(payload, 0, dirty_end - payload);
+    }
+    *(sf_footer *)(end - 8) = 0;
+}
+
+void *sf_malloc_cacheline(size_t size) {
+    if(trace_file != NULL && traceEnter()) {
+        void *pp = sf_malloc_cacheline(size);
+        traceRecord(SF_TRACE_MEMALIGN, NULL, pp, size, CACHE_LINE_SIZE);
+        traceLeave();
+        return pp;
+    }
+
+    if(size == 0)
+        return NULL;
+
+    // Payload fills whole cache lines and the header sits at the end of the line before
+    size_t payload = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    size_t total_size = payload + 8;
+    size_t index = payload / CACHE_LINE_SIZE - 1;
+    __atomic_store_n(&cacheline_used, 1, __ATOMIC_RELAXED);
+
+    sf_arena *arena = threadArena();
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+
+    sf_block *alloc_block = NULL;
+    if(index < CACHELINE_CLASSES && arena->cacheline_bins[index] != NULL) {
+        alloc_block = arena->cacheline_bins[index];
+        arena->cacheline_bins[index] = alloc_block->body.links.next;
+        arena->cacheline_lengths[index] -= 1;
+
+        alloc_block->body.links.next = NULL;
+        setAllocBlock(alloc_block, total_size);
+    }
+    else {
+        alloc_block = allocateAligned(total_size, CACHE_LINE_SIZE);
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    // A secondary arena that cannot get another chunk falls back to the main arena
+    if(alloc_block == NULL && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        cur_arena = &main_arena;
+        alloc_block = allocateAligned(total_size, CACHE_LINE_SIZE);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+
+    if(alloc_block == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    countRequest(size, total_size, alloc_block->header & SIZE);
+    return (char *)alloc_block + 8;
+}
+
+int getCachelineIndex(sf_block *block, size_t size) {
+    // Bin index for a block of the given size whose payload is cache line aligned,
+    // or -1 if the block does not belong in any bin
+    if(((uintptr_t)block + 8) % CACHE_LINE_SIZE != 0 || (size - 8) % CACHE_LINE_SIZE != 0) {
+        return -1;
+    }
+
+    size_t index = (size - 8) / CACHE_LINE_SIZE - 1;
+    return (index < CACHELINE_CLASSES) ? (int)index : -1;
+}
+
+void addToCachelineBin(sf_block *block, int index) {
+    // Inserting into a full bin returns its blocks to the main free lists first
+    if(cur_arena->cacheline_lengths[index] == CACHELINE_BIN_MAX) {
+        flushBlocks(cur_arena->cacheline_bins[index], 0);
+        cur_arena->cacheline_bins[index] = NULL;
+        cur_arena->cacheline_lengths[index] = 0;
+    }
+
+    block->header |= IN_QUICK_LIST | THIS_BLOCK_ALLOCATED;
+    block->body.links.next = cur_arena->cacheline_bins[index];
+    cur_arena->cacheline_bins[index] = block;
+    cur_arena->cacheline_lengths[index] += 1;
+}
+
+size_t alignedLead(sf_block *block, size_t align) {
+    // Bytes from block to the first header whose payload is aligned, which is
+    // either 0 or at least MIN_BLOCK_SIZE so the front can stand as a free block
+    uintptr_t payload = (uintptr_t)block + 8;
+    size_t lead = (align - payload % align) % align;
+    while(lead != 0 && lead < MIN_BLOCK_SIZE) {
+        lead += align;
+    }
+
+    return lead;
+}
+
+sf_block *carveAligned(sf_block *block, size_t lead, size_t adjSize) {
+    // Frees the lead bytes in front of the allocated block and anything past adjSize
+    // behind it that would not be a splinter.  Returns the aligned block.
+    size_t size = block->header & SIZE;
+    sf_block *aligned = block;
+
+    if(lead != 0) {
+        // The front becomes free, so the aligned block's prev alloc bit is cleared
+        aligned = (sf_block *)((char *)block + lead);
+        aligned->header = (size - lead) | THIS_BLOCK_ALLOCATED;
+        block->header = lead | (block->header & PREV_BLOCK_ALLOCATED) | THIS_BLOCK_ALLOCATED;
+        freeToMainList(block);
+        size -= lead;
+    }
+
+    if(size - adjSize >= MIN_BLOCK_SIZE) {
+        sf_block *rest = (sf_block *)((char *)aligned + adjSize);
+        rest->header = (size - adjSize) | PREV_BLOCK_ALLOCATED;
+        setAllocBlock(aligned, adjSize);
+        freeToMainList(rest);
+    }
+
+    return aligned;
+}
+
+sf_block *mapBlock(size_t adjSize) {
+    // A mapped block starts MAPPED_PREFIX bytes into its own mapping, after the length
+    // of the mapping and a tag tying the block to its address.  Its header has both
+    // allocated bits set, so nothing ever tries to coalesce with it.
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(adjSize > SIZE_MAX - MAPPED_PREFIX - page) {
+        return NULL;
+    }
+
+    size_t length = (adjSize + MAPPED_PREFIX + page - 1) & ~(page - 1);
+    LATENCY_PATH(LATENCY_MEMORY);
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        return NULL;
+    }
+
+    sf_block *block = (sf_block *)(base + MAPPED_PREFIX);
+    ((size_t *)base)[0] = length;
+    ((uintptr_t *)base)[1] = MAPPED_TAG ^ (uintptr_t)block;
+    block->header = (length - MAPPED_PREFIX) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED;
+
+    __atomic_add_fetch(&mmap_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_bytes, length, __ATOMIC_RELAXED);
+    return block;
+}
+
+sf_block *remapBlock(sf_block *block, size_t adjSize) {
+    // Resizes the mapping of a mapped block, letting the kernel move its pages
+    char *base = (char *)block - MAPPED_PREFIX;
+    size_t length = ((size_t *)base)[0];
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(adjSize > SIZE_MAX - MAPPED_PREFIX - page) {
+        return NULL;
+    }
+
+    size_t new_length = (adjSize + MAPPED_PREFIX + page - 1) & ~(page - 1);
+    if(new_length == length) {
+        return block;
+    }
+
+    LATENCY_PATH(LATENCY_MEMORY);
+
+    char *new_base = mremap(base, length, new_length, MREMAP_MAYMOVE);
+    if(new_base == MAP_FAILED) {
+        return NULL;
+    }
+
+    block = (sf_block *)(new_base + MAPPED_PREFIX);
+    ((size_t *)new_base)[0] = new_length;
+    ((uintptr_t *)new_base)[1] = MAPPED_TAG ^ (uintptr_t)block;
+    block->header = (new_length - MAPPED_PREFIX) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED;
+
+    __atomic_add_fetch(&mmap_bytes, new_length - length, __ATOMIC_RELAXED);
+    return block;
+}
+
+void unmapBlock(sf_block *block) {
+    char *base = (char *)block - MAPPED_PREFIX;
+    size_t length = ((size_t *)base)[0];
+    LATENCY_PATH(LATENCY_MEMORY);
+    munmap(base, length);
+
+    __atomic_sub_fetch(&mmap_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mmap_bytes, length, __ATOMIC_RELAXED);
+}
+
+int isMappedBlock(sf_block *block) {
+    // Mapped blocks lie outside the heap, at a fixed offset into a page, behind their tag.
+    // The tag shares the block's page, so checking it cannot fault.
+    if((char *)block >= (char *)heapStart() && (char *)block < (char *)heapEnd()) {
+        return 0;
+    }
 
-        // Set new coalesce block
-         sf_block *free;
-        if((*footer & PREV_BLOCK_ALLOCATED) == 0) {
-            free = setFreeBlock((sf_block *)top, top_size + current_size, 0);
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(((uintptr_t)block - MAPPED_PREFIX) % page != 0) {
+        return 0;
+    }
+
+    uintptr_t tag = ((uintptr_t *)((char *)block - MAPPED_PREFIX))[1];
+    return tag == (MAPPED_TAG ^ (uintptr_t)block);
+}
+
+int sf_set_mmap_threshold(size_t threshold) {
+    if(threshold != 0 && threshold < MMAP_THRESHOLD_MIN) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    if(threshold != 0) {
+        __atomic_store_n(&mmap_used, 1, __ATOMIC_RELAXED);
+    }
+    mmap_threshold = threshold;
+    return 0;
+}
+
+void sf_stats(sf_stats_counters *counters) {
+    // Each arena is read under its own lock, so while other threads allocate the
+    // totals are only consistent per arena
+    memset(counters, 0, sizeof(*counters));
+    size_t cached = 0;
+    size_t free_bytes = 0;
+    int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++) {
+        sf_arena *arena = arenas[i];
+        pthread_mutex_lock(&arena->lock);
+        for(int j = 0; j < NUM_QUICK_LISTS; j++) {
+            counters->quick_hits[j] += arena->quick_hits[j];
+            counters->quick_misses[j] += arena->quick_misses[j];
+            counters->quick_flushes[j] += arena->quick_flushes[j];
+            cached += (size_t)arena->quick_lists[j].length * (MIN_BLOCK_SIZE + j * ALIGN_SIZE);
         }
-        else {
-            free = setFreeBlock((sf_block *)top, top_size + current_size, 1);
+        for(int j = 0; j < CACHELINE_CLASSES; j++) {
+            cached += (size_t)arena->cacheline_lengths[j] * ((j + 1) * CACHE_LINE_SIZE + 8);
         }
-        
-        addToFreeList(free);
-        // sf_show_heap();
-        return free;
+        for(int j = 0; j < NUM_FREE_LISTS; j++) {
+            counters->list_hits[j] += arena->list_hits[j];
+            counters->list_misses[j] += arena->list_misses[j];
+            counters->splits[j] += arena->splits[j];
+            counters->coalesces[j] += arena->coalesces[j];
+        }
+        free_bytes += arena->free_bytes;
+        pthread_mutex_unlock(&arena->lock);
     }
 
+    pthread_mutex_lock(&main_arena.lock);
+    size_t heap_size = (size_t)((char *)heapEnd() - (char *)heapStart());
+    counters->heap_size = heap_size;
+    counters->peak_heap = peak_heap;
+    counters->grow_calls = grow_calls;
+    counters->pages_grown = pages_grown;
+
+    // Prologue, epilogue and any alignment padding of the heap, and the header,
+    // prologue and epilogue of every secondary arena chunk
+    size_t overhead = 0;
+    if(prologue != NULL) {
+        overhead = (size_t)((char *)prologue - (char *)heapStart()) + MIN_BLOCK_SIZE + 8;
+    }
+    overhead += (size_t)__atomic_load_n(&num_arena_chunks, __ATOMIC_ACQUIRE) * (8 + MIN_BLOCK_SIZE + 8);
+    pthread_mutex_unlock(&main_arena.lock);
 
-    // Top is allocated and bottom is free
-    else if((block->header & PREV_BLOCK_ALLOCATED) != 0 && (bottom->header & THIS_BLOCK_ALLOCATED) == 0) {
-        size_t current_size = block->header & SIZE;
-        size_t bottom_size = bottom->header & SIZE;
+    counters->bytes_free = free_bytes;
+    counters->bytes_cached = cached;
+    if(heap_size > free_bytes + cached + overhead) {
+        counters->bytes_in_use = heap_size - free_bytes - cached - overhead;
+    }
+    counters->mmap_count = __atomic_load_n(&mmap_count, __ATOMIC_RELAXED);
+    counters->mmap_bytes = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+}
 
-        removeFromFreeList(bottom);
-        // printf("BOTTOM SIZE: %ld\n", bottom_size);
-        sf_block *free = setFreeBlock((sf_block *)block, current_size + bottom_size, 1);
-        addToFreeList(free);
-        return free;
+void countRequest(size_t size, size_t adjSize, size_t blockSize) {
+    // Records one allocation of size bytes that needed a block of adjSize bytes and
+    // got one of blockSize bytes
+    frag_local.requested += size;
+    frag_local.rounding += adjSize - 8 - size;
+    frag_local.splinters += blockSize - adjSize;
+    frag_local.blocks += blockSize;
+    if(++frag_local.events >= FRAG_FOLD_EVENTS) {
+        foldFragTotals();
     }
+}
 
-    // Top and bottom are allocated
-    else {
-        sf_block *free = setFreeBlock((sf_block *)block, block->header & SIZE, 1);
-        addToFreeList(free);
-        return free;
+void foldFragTotals() {
+    __atomic_add_fetch(&frag_shared.requested, frag_local.requested, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&frag_shared.rounding, frag_local.rounding, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&frag_shared.splinters, frag_local.splinters, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&frag_shared.blocks, frag_local.blocks, __ATOMIC_RELAXED);
+    memset(&frag_local, 0, sizeof(frag_local));
+}
 
+void updatePeak() {
+    // Called under cur_arena's lock once an allocation has taken its block
+    size_t allocated = cur_arena->managed_bytes - cur_arena->free_bytes;
+    if(allocated > cur_arena->peak_allocated) {
+        cur_arena->peak_allocated = allocated;
     }
 }
 
+size_t largestFree() {
+    // The largest free block of cur_arena: the wilderness, the largest other top class
+    // block, or the largest size with a non-zero count below the top class
+    size_t largest = cur_arena->wilderness != NULL ? cur_arena->wilderness->header & SIZE : 0;
+    if(cur_arena->large_free_max > largest) {
+        largest = cur_arena->large_free_max;
+    }
 
-void sf_free(void *pp) {
-    // Pointer is null or not 8 byte aligned
-    if(pp == NULL || (uintptr_t)pp % 8 != 0) {
-        abort();
+    unsigned int words = cur_arena->small_free_words;
+    if(words != 0) {
+        int word = 31 - __builtin_clz(words);
+        int bit = 63 - __builtin_clzl(cur_arena->small_free_sizes[word]);
+        size_t size = ((size_t)word * 64 + bit + 1) * ALIGN_SIZE;
+        if(size > largest) {
+            largest = size;
+        }
     }
 
-    char *header = (char *)pp - 8;
-    sf_block *block = (sf_block *)header;
+    return largest;
+}
 
-    // Block size is < 32 or size is not a multiple of 8
-    if((block->header & SIZE) < 32 || (block->header & SIZE) % 8 != 0) {
-        abort();
+void sf_frag_report(sf_frag_counters *report) {
+    memset(report, 0, sizeof(*report));
+    int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++) {
+        sf_arena *arena = arenas[i];
+        pthread_mutex_lock(&arena->lock);
+        cur_arena = arena;
+        report->allocated_bytes += arena->managed_bytes - arena->free_bytes;
+        report->peak_allocated += arena->peak_allocated;
+        report->free_bytes += arena->free_bytes;
+        size_t largest = largestFree();
+        if(largest > report->largest_free) {
+            report->largest_free = largest;
+        }
+        pthread_mutex_unlock(&arena->lock);
     }
 
-    // Header is before the start of the heap or footer of the block is after the end of the last block of the heap
-    sf_footer *footer = (sf_footer *)block + (block->header & SIZE) - 8;
-    if(block < (sf_block *)sf_mem_start() || footer > (sf_footer *)sf_mem_end()) {
-        abort();
+    pthread_mutex_lock(&main_arena.lock);
+    report->heap_size = (size_t)((char *)heapEnd() - (char *)heapStart());
+    report->peak_heap = peak_heap;
+    pthread_mutex_unlock(&main_arena.lock);
+
+    // The calling thread's own requests are always included
+    foldFragTotals();
+    report->requested_bytes = __atomic_load_n(&frag_shared.requested, __ATOMIC_RELAXED);
+    report->rounding_bytes = __atomic_load_n(&frag_shared.rounding, __ATOMIC_RELAXED);
+    report->splinter_bytes = __atomic_load_n(&frag_shared.splinters, __ATOMIC_RELAXED);
+    size_t blocks = __atomic_load_n(&frag_shared.blocks, __ATOMIC_RELAXED);
+
+    if(report->peak_heap != 0) {
+        report->peak_utilization = (double)report->peak_allocated / report->peak_heap;
     }
-    // Block bit is not allocated or quicklist bit is allocated 
-    if((block->header & THIS_BLOCK_ALLOCATED) == 0 || (block->header & IN_QUICK_LIST) != 0)
-        abort();
+    if(blocks != 0) {
+        report->internal_fragmentation = (double)(report->rounding_bytes + report->splinter_bytes) / blocks;
+    }
+    if(report->free_bytes != 0) {
+        report->external_fragmentation = 1.0 - (double)report->largest_free / report->free_bytes;
+    }
+}
 
-    // sf_show_heap();
+int sf_trace_start(const char *path) {
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file != NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        sf_errno = EINVAL;
+        return -1;
+    }
 
-    // Prev alloc bit is 0 but the prev block is allocated
-    if((block->header & PREV_BLOCK_ALLOCATED) == 0) {
-        sf_footer *prev_footer = (sf_footer *)block - 8;
+    FILE *file = fopen(path, "wb");
+    if(file == NULL) {
+        sf_errno = errno;
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
 
-        if((*prev_footer & THIS_BLOCK_ALLOCATED) != 0) {
-            abort();
-        }
+    fwrite(SF_TRACE_MAGIC, 1, strlen(SF_TRACE_MAGIC), file);
+    fputc(SF_TRACE_VERSION, file);
+    trace_next_id = 0;
+    trace_file = file;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void sf_trace_stop() {
+    pthread_mutex_lock(&trace_lock);
+    traceClose();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void traceClose() {
+    // Closes the trace and forgets its blocks; the caller holds trace_lock
+    if(trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+
+    tableClear(&trace_blocks);
+    free(trace_free_ids);
+    trace_free_ids = NULL;
+    trace_free_count = 0;
+}
+
+int traceEnter() {
+    // Called by an entry point that saw trace_file set.  Returns 1 with trace_lock held
+    // if the call is to be recorded, or 0 if it was made by another entry point.
+    if(trace_nested) {
+        return 0;
     }
 
-    // Check if the block size matches quick list
-    size_t block_size = block->header & SIZE;
-    int index = 0;
+    pthread_mutex_lock(&trace_lock);
+    trace_nested = 1;
+    return 1;
+}
 
-    while(index < NUM_QUICK_LISTS) {
+void traceLeave() {
+    trace_nested = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
 
-        /*  Quick List:
-    - sf_quick_lists[NUM_QUICK_LISTS] os size [20] contains pointers to the quick lists in LIFO fashion
-    - sf_quick_lists[0] contains quick lists with size of MIN_BLOCK_SIZE
-    - size of quicklist = MIN_BLOCK_SIZE + (index * 8)
-    - contains length field with a max of 5 blocks in each quick list 
-    - inserting into a quick list at capcity causes it to be flushed and the existing blocks in the quick list are removed from the quick list and added 
-        to the main free list, after coalescing, if possible.
-    */ 
-
-        size_t quick_size = 32 + (index * 8);
-        // Check if block size matches quick list size
-        if(block_size == quick_size) {
-            // Insert into quicklist
-            
-            // Quick list is full 
-            if(sf_quick_lists[index].length == 5) {
-                // Flush the quicklist and add to main free list
-                sf_block *pointer = sf_quick_lists[index].first->body.links.next;
-                int count = 0;
-                while(count < 5) {
-                    sf_block *next = pointer->body.links.next;
-                    if((pointer->header & PREV_BLOCK_ALLOCATED) == 0) {
-                        setFreeBlock(pointer, pointer->header & SIZE, 0);
-                    }
-                    else {
-                        setFreeBlock(pointer, pointer->header & SIZE, 1);
-                    }
-                    
-                    addToFreeList(pointer);
-
-                    pointer = next;
-                }
-                sf_quick_lists[index].length = 0;
-            }
-            int prev = 0;
-            if((block->header & PREV_BLOCK_ALLOCATED) == 0)
-                prev = 0;
-            else
-                prev = 1;
-
-            // Insert into quicklist
-            // Change the block into a quick list block
-            sf_block *new_block = block;
-            new_block->header = block->header & SIZE;
-            new_block->header |= IN_QUICK_LIST | THIS_BLOCK_ALLOCATED;
-            
- 
-
-            if(prev == 0) {
-                new_block->header &= ~PREV_BLOCK_ALLOCATED;
-            }
-            else {
-                new_block->header |= PREV_BLOCK_ALLOCATED;
+void traceRecord(int op, void *old, void *pp, size_t size, size_t align) {
+    // Records a call that returned pp; old is the block a free or realloc was given
+    if(trace_file == NULL) {
+        return;
+    }
+
+    long id;
+    if(op == SF_TRACE_FREE || (op == SF_TRACE_REALLOC && size == 0)) {
+        // Blocks allocated before recording started are not in the trace
+        id = tableTake(&trace_blocks, old);
+        if(id < 0) {
+            return;
+        }
+
+        if(trace_free_count % 1024 == 0) {
+            unsigned long *ids = realloc(trace_free_ids, (trace_free_count + 1024) * sizeof(*ids));
+            if(ids == NULL) {
+                traceClose();
+                return;
             }
+            trace_free_ids = ids;
+        }
+        trace_free_ids[trace_free_count++] = id;
+
+        fputc(SF_TRACE_FREE, trace_file);
+        traceVarint(id);
+        return;
+    }
+
+    if(pp == NULL) {
+        return;
+    }
 
+    // A realloc keeps the ID of its block; one of a block the trace does not know is
+    // recorded as the allocation it is to the trace
+    id = op == SF_TRACE_REALLOC ? tableTake(&trace_blocks, old) : -1;
+    if(id < 0) {
+        op = op == SF_TRACE_REALLOC ? SF_TRACE_MALLOC : op;
+        id = trace_free_count > 0 ? (long)trace_free_ids[--trace_free_count] : (long)trace_next_id++;
+    }
 
-            // Set next and prev pointers in quicklist
-            sf_block *old_first = sf_quick_lists[index].first;
-            sf_quick_lists[index].first = new_block;
+    if(tableInsert(&trace_blocks, pp, id) != 0) {
+        traceClose();
+        return;
+    }
 
-            new_block->body.links.next = old_first;
-            
-            sf_quick_lists[index].length += 1;
+    fputc(op, trace_file);
+    traceVarint(id);
+    traceVarint(size);
+    if(op == SF_TRACE_MEMALIGN) {
+        traceVarint(align);
+    }
+}
 
-            //Set the bottom block prev bit to 1
-            char *bottom_ptr = (char *)new_block + (new_block->header & SIZE);
-            sf_block *bottom = (sf_block *)bottom_ptr;
-            bottom->header |= PREV_BLOCK_ALLOCATED;
+void traceVarint(size_t value) {
+    // Seven bits per byte, lowest first, with the top bit set on every byte but the last
+    while(value >= 0x80) {
+        fputc((int)(value & 0x7F) | 0x80, trace_file);
+        value >>= 7;
+    }
+    fputc((int)value, trace_file);
+}
 
-            return;
+size_t tableSlot(struct pointer_table *table, void *key) {
+    return (size_t)(((uintptr_t)key >> 3) * 0x9E3779B97F4A7C15UL >> 17) & (table->capacity - 1);
+}
+
+int tableInsert(struct pointer_table *table, void *key, unsigned long value) {
+    // Adds a key that is not in the table, doubling the table first if it would get
+    // more than half full.  Returns -1 if it cannot grow.
+    if((table->live + 1) * 2 > table->capacity) {
+        struct pointer_table old = *table;
+        size_t capacity = old.capacity == 0 ? 1024 : old.capacity * 2;
+        void **keys = calloc(capacity, sizeof(*keys));
+        unsigned long *values = malloc(capacity * sizeof(*values));
+        if(keys == NULL || values == NULL) {
+            free(keys);
+            free(values);
+            return -1;
+        }
+
+        table->keys = keys;
+        table->values = values;
+        table->capacity = capacity;
+        table->live = 0;
+        for(size_t i = 0; i < old.capacity; i++) {
+            if(old.keys[i] != NULL) {
+                tableInsert(table, old.keys[i], old.values[i]);
+            }
         }
-        index++;
+        free(old.keys);
+        free(old.values);
     }
 
-    // Add to the main free list
-    if((block->header & PREV_BLOCK_ALLOCATED) == 0) {
-        block = setFreeBlock(block, block->header & SIZE, 0);
+    size_t slot = tableSlot(table, key);
+    while(table->keys[slot] != NULL) {
+        slot = (slot + 1) & (table->capacity - 1);
     }
+    table->keys[slot] = key;
+    table->values[slot] = value;
+    table->live++;
+    return 0;
+}
 
-    else {
-        block = setFreeBlock(block, block->header & SIZE, 1);
+long tableFind(struct pointer_table *table, void *key) {
+    // Returns the slot of key, or -1 if it is not in the table
+    if(table->capacity == 0 || key == NULL) {
+        return -1;
     }
-    
-    // sf_show_heap();
-    block = coalesce(block);
 
-    // Set the bottom block prev bit to 0
-    sf_block * bottom = (sf_block *)((char *)block + (block->header & SIZE));
-    bottom->header &= ~PREV_BLOCK_ALLOCATED; 
+    size_t slot = tableSlot(table, key);
+    while(table->keys[slot] != key) {
+        if(table->keys[slot] == NULL) {
+            return -1;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return (long)slot;
+}
+
+long tableTake(struct pointer_table *table, void *key) {
+    // Removes key from the table and returns its value, or -1 if it is not there
+    long found = tableFind(table, key);
+    if(found < 0) {
+        return -1;
+    }
 
-    // printf("BOTOTM BLOCK\n");
-    // sf_show_block(bottom);
+    size_t mask = table->capacity - 1;
+    size_t slot = (size_t)found;
+    long value = (long)table->values[slot];
+    table->live--;
+
+    // Shifts later entries of the probe run back into the hole, so lookups never need tombstones
+    size_t hole = slot;
+    for(size_t next = (slot + 1) & mask; table->keys[next] != NULL; next = (next + 1) & mask) {
+        size_t home = tableSlot(table, table->keys[next]);
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            table->keys[hole] = table->keys[next];
+            table->values[hole] = table->values[next];
+            hole = next;
+        }
+    }
+    table->keys[hole] = NULL;
+    return value;
 }
 
-void *sf_realloc(void *pp, size_t rsize) {
-    char *header = (char *)pp - 8;
-    sf_block *block = (sf_block *)header;
+void tableClear(struct pointer_table *table) {
+    free(table->keys);
+    free(table->values);
+    memset(table, 0, sizeof(*table));
+}
 
-     // Pointer is null or not 8 byte aligned
-    if(pp == NULL || (uintptr_t)pp % 8 != 0) {
-        sf_errno = EINVAL;
-        return NULL;
+#ifdef LATENCY_HISTOGRAMS
+int latencyEnter() {
+    // Starts timing a call unless another entry point made it; returns 1 if it did
+    if(latency_nested) {
+        return 0;
     }
 
-    // Block size is < 32 or size is not a multiple of 8
-    if((block->header & SIZE) < 32 || (block->header & SIZE) % 8 != 0) {
-        sf_errno = EINVAL;
-        return NULL;
+    latency_nested = 1;
+    latency_path = LATENCY_QUICK;
+    latency_start = latencyNow();
+    return 1;
+}
+
+void latencyLeave(int entry) {
+    unsigned long elapsed = latencyNow() - latency_start;
+    latency_nested = 0;
+    __atomic_fetch_add(&latency_buckets[entry][latency_path][latencyBucket(elapsed)], 1, __ATOMIC_RELAXED);
+}
+
+unsigned long latencyNow() {
+    // The time stamp counter where there is one, it is far cheaper to read than the clock
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+#endif
+}
+
+int latencyBucket(unsigned long value) {
+    // Values below 2 * LATENCY_SUB_BUCKETS get a bucket each; above that, each power
+    // of two is split four ways by the two bits below its leading one
+    if(value < 2 * LATENCY_SUB_BUCKETS) {
+        return (int)value;
     }
 
-    // Header is before the start of the heap or footer of the block is after the end of the last block of the heap
-    sf_footer *footer = (sf_footer *)block + (block->header & SIZE) - 8;
-    if(block < (sf_block *)sf_mem_start() || footer > (sf_footer *)sf_mem_end()) {
-        sf_errno = EINVAL;
-        return NULL;
+    int exponent = 63 - __builtin_clzl(value);
+    return (exponent - 1) * LATENCY_SUB_BUCKETS + (int)((value >> (exponent - 2)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+unsigned long latencyBound(int bucket) {
+    // Largest value that falls in bucket
+    if(bucket < 2 * LATENCY_SUB_BUCKETS) {
+        return (unsigned long)bucket;
     }
 
-    // Block bit is not allocated or quicklist bit is allocated 
-    if((block->header & THIS_BLOCK_ALLOCATED) == 0 || (block->header & IN_QUICK_LIST) != 0) {
-        sf_errno = EINVAL;
-        return NULL;
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 1;
+    unsigned long low = (unsigned long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (exponent - 2);
+    return low + ((1UL << (exponent - 2)) - 1);
+}
+#endif
+
+void sf_latency(int entry, int path, sf_latency_summary *summary) {
+    memset(summary, 0, sizeof(*summary));
+#ifdef LATENCY_HISTOGRAMS
+    if(entry < 0 || entry >= LATENCY_ENTRIES || path < 0 || path >= LATENCY_PATHS) {
+        return;
     }
-        
 
-    // sf_show_heap();
+    unsigned long counts[LATENCY_BUCKETS];
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&latency_buckets[entry][path][i], __ATOMIC_RELAXED);
+        summary->count += counts[i];
+    }
+    if(summary->count == 0) {
+        return;
+    }
 
-    // Prev alloc bit is 0 but the prev block is allocated
-    if((block->header & PREV_BLOCK_ALLOCATED) == 0) {
-        sf_footer *prev_footer = (sf_footer *)block - 8;
+    // Each percentile is the bucket holding the sample of that rank, rounded up
+    unsigned long p50 = (summary->count * 500 + 999) / 1000;
+    unsigned long p99 = (summary->count * 990 + 999) / 1000;
+    unsigned long p999 = (summary->count * 999 + 999) / 1000;
+    unsigned long seen = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        if(counts[i] == 0) {
+            continue;
+        }
 
-        if((*prev_footer & THIS_BLOCK_ALLOCATED) != 0) {
-            sf_errno = EINVAL;
-            return NULL;
+        seen += counts[i];
+        if(summary->p50 == 0 && seen >= p50) {
+            summary->p50 = latencyBound(i);
+        }
+        if(summary->p99 == 0 && seen >= p99) {
+            summary->p99 = latencyBound(i);
+        }
+        if(summary->p999 == 0 && seen >= p999) {
+            summary->p999 = latencyBound(i);
         }
+        summary->max = latencyBound(i);
     }
+#endif
+}
 
-    if(rsize == 0) {
-        sf_block *block = (sf_block *)pp;
-        if((block->header |= PREV_BLOCK_ALLOCATED) == 0) {
-            setFreeBlock((sf_block *)pp, rsize, 0);
+void sf_latency_dump() {
+#ifdef LATENCY_HISTOGRAMS
+    static const char *entries[LATENCY_ENTRIES] = { "malloc", "free", "realloc", "memalign" };
+    static const char *paths[LATENCY_PATHS] = { "quick", "list", "memory" };
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+
+    printf("%-10s %-8s %10s %10s %10s %10s %10s  (%s)\n", "entry", "path", "count", "p50", "p99", "p99.9", "max", unit);
+    for(int entry = 0; entry < LATENCY_ENTRIES; entry++) {
+        for(int path = 0; path < LATENCY_PATHS; path++) {
+            sf_latency_summary summary;
+            sf_latency(entry, path, &summary);
+            if(summary.count != 0) {
+                printf("%-10s %-8s %10lu %10lu %10lu %10lu %10lu\n", entries[entry], paths[path],
+                       summary.count, summary.p50, summary.p99, summary.p999, summary.max);
+            }
         }
-        else {
-            setFreeBlock((sf_block *)pp, rsize, 1);
+    }
+#else
+    printf("Latency histograms are only kept in debug and profile builds\n");
+#endif
+}
+
+void sf_latency_reset() {
+#ifdef LATENCY_HISTOGRAMS
+    for(int entry = 0; entry < LATENCY_ENTRIES; entry++) {
+        for(int path = 0; path < LATENCY_PATHS; path++) {
+            for(int i = 0; i < LATENCY_BUCKETS; i++) {
+                __atomic_store_n(&latency_buckets[entry][path][i], 0, __ATOMIC_RELAXED);
+            }
         }
-        
-        return NULL;
     }
+#endif
+}
 
-    // Calculate block size including needed padding
-    size_t total_size;
+void sf_set_heap_sampling(size_t rate) {
+    __atomic_store_n(&sample_rate, rate, __ATOMIC_RELAXED);
+    sample_countdown = rate == 0 ? SAMPLE_RECHECK : sampleInterval(rate);
+}
 
-    if(rsize < 32) {
-        total_size = 32;
+int sampleEnter() {
+    // Called by an allocation whose countdown ran out.  Starts the next interval and
+    // returns 1 if the allocation is to be sampled.
+    if(sample_nested) {
+        return 0;
+    }
+
+    size_t rate = __atomic_load_n(&sample_rate, __ATOMIC_RELAXED);
+    if(rate == 0) {
+        sample_countdown = SAMPLE_RECHECK;
+        return 0;
+    }
+
+    sample_countdown = sampleInterval(rate);
+    sample_nested = 1;
+    return 1;
+}
+
+void sampleLeave(void *pp, size_t size, size_t weight) {
+    // Adds the block a sampled call returned to the profile, standing for weight
+    // bytes, or for as many as a sample of size bytes does on average if weight is 0
+    sample_nested = 0;
+    if(pp == NULL) {
+        return;
+    }
+
+    // The first frame is this function
+    void *frames[SAMPLE_DEPTH + 1];
+    int depth = backtrace(frames, SAMPLE_DEPTH + 1) - 1;
+
+    // A request of size bytes is sampled with probability 1 - e^(-size / rate), so
+    // on average each sample stands for size divided by that many bytes
+    size_t rate = __atomic_load_n(&sample_rate, __ATOMIC_RELAXED);
+    if(weight == 0) {
+        double probability = rate != 0 ? -expm1(-(double)size / rate) : 1;
+        weight = probability > 0 ? (size_t)(size / probability) : size;
+    }
+
+    pthread_mutex_lock(&sample_lock);
+    sampleAdd(pp, size, weight, frames + 1, depth);
+    pthread_mutex_unlock(&sample_lock);
+}
+
+void sampleRestore(void *pp, unsigned long site, size_t size, size_t weight) {
+    // Puts a block sampleFree took out back under its call site, as it was
+    sample_nested = 0;
+    if(pp == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&sample_lock);
+    sampleFile(pp, site, size, weight);
+    pthread_mutex_unlock(&sample_lock);
+}
+
+void sampleAdd(void *pp, size_t size, size_t weight, void **frames, int depth) {
+    // Files the sample under its call site; the caller holds sample_lock.  A sample
+    // there is no memory to keep track of is dropped.
+    uintptr_t hash = 14695981039346656037UL;
+    for(int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211UL;
     }
+    void *key = (void *)(hash | 1);
 
+    long found = tableFind(&sample_site_index, key);
+    unsigned long site;
+    if(found >= 0) {
+        site = sample_site_index.values[found];
+    }
     else {
-        // Non-zero:
-        total_size = rsize + 8;
-        if(total_size % 8 != 0) {
-            total_size = total_size + 8 - (total_size % 8);
+        if(sample_site_count == sample_site_capacity) {
+            size_t capacity = sample_site_capacity == 0 ? 64 : sample_site_capacity * 2;
+            struct sample_site *sites = realloc(sample_sites, capacity * sizeof(*sites));
+            if(sites == NULL) {
+                return;
+            }
+            sample_sites = sites;
+            sample_site_capacity = capacity;
+        }
+        if(tableInsert(&sample_site_index, key, sample_site_count) != 0) {
+            return;
         }
+
+        site = sample_site_count++;
+        memcpy(sample_sites[site].frames, frames, depth * sizeof(*frames));
+        sample_sites[site].depth = depth;
+        sample_sites[site].bytes = 0;
     }
 
-    // Reallocating to larger size
-    if((block->header & SIZE) - 8 < rsize) {
-        void *pointer = sf_malloc(rsize);
+    sampleFile(pp, site, size, weight);
+}
 
-        if(pointer == NULL) {
-            return NULL;
+void sampleFile(void *pp, unsigned long site, size_t size, size_t weight) {
+    // Records pp as a live sample of site; the caller holds sample_lock
+    unsigned long slot;
+    if(sample_free_count > 0) {
+        slot = sample_free_slots[--sample_free_count];
+    }
+    else {
+        if(sample_slot_count == sample_slot_capacity) {
+            size_t capacity = sample_slot_capacity == 0 ? 256 : sample_slot_capacity * 2;
+            struct sample_slot *slots = realloc(sample_slots, capacity * sizeof(*slots));
+            if(slots == NULL) {
+                return;
+            }
+            sample_slots = slots;
+            unsigned long *free_slots = realloc(sample_free_slots, capacity * sizeof(*free_slots));
+            if(free_slots == NULL) {
+                return;
+            }
+            sample_free_slots = free_slots;
+            sample_slot_capacity = capacity;
         }
+        slot = sample_slot_count++;
+    }
 
-        memcpy(pointer, pp, (block->header & SIZE) - 8);
+    if(tableInsert(&sample_blocks, pp, slot) != 0) {
+        sample_free_slots[sample_free_count++] = slot;
+        return;
+    }
 
-        sf_free(pp);
-        return pointer;
+    sample_slots[slot] = (struct sample_slot){ site, size, weight };
+    sample_sites[site].bytes += weight;
+    __atomic_fetch_add(&sample_filter[sampleFilterIndex(pp)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sample_live, 1, __ATOMIC_RELAXED);
+}
+
+size_t sampleFree(void *pp, unsigned long *site, size_t *weight) {
+    // Takes pp out of the profile if it was sampled.  Returns the size it was
+    // requested with and sets site and weight, if given, to its call site and the
+    // bytes it stood for, or returns 0 if it was not sampled.
+    size_t index = sampleFilterIndex(pp);
+    if(__atomic_load_n(&sample_filter[index], __ATOMIC_RELAXED) == 0) {
+        return 0;
     }
 
-    // Reallocating to smaller size
-    else if((block->header & SIZE) - 8 > rsize) {
-        // Case 1: Splitting results in splinter
-        if((block->header & SIZE) - total_size < 32) {
-            return pp;
+    pthread_mutex_lock(&sample_lock);
+    long slot = tableTake(&sample_blocks, pp);
+    size_t size = 0;
+    if(slot >= 0) {
+        struct sample_slot *sample = &sample_slots[slot];
+        sample_sites[sample->site].bytes -= sample->weight;
+        size = sample->size;
+        if(site != NULL) {
+            *site = sample->site;
         }
+        if(weight != NULL) {
+            *weight = sample->weight;
+        }
+        sample_free_slots[sample_free_count++] = slot;
+        __atomic_fetch_sub(&sample_filter[index], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&sample_live, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&sample_lock);
+    return size;
+}
 
-        // Case 2: Split the blocks
-        else if((block->header & SIZE) - total_size >= 32) {
-            // Set free block
-            char *new_free_pointer = (char *)block + total_size;
-            sf_block *new_free = setFreeBlock((sf_block *)new_free_pointer, (block->header & SIZE) - total_size, 1);
+long sampleInterval(size_t rate) {
+    // Exponentially distributed with a mean of rate, so every byte is equally likely
+    // to be the one a sample lands on
+    if(sample_seed == 0) {
+        sample_seed = (uintptr_t)&sample_seed ^ (unsigned long)time(NULL) ^ 0x9E3779B97F4A7C15UL;
+    }
+    sample_seed ^= sample_seed >> 12;
+    sample_seed ^= sample_seed << 25;
+    sample_seed ^= sample_seed >> 27;
+    double uniform = ((sample_seed * 0x2545F4914F6CDD1DUL >> 11) + 1) * 0x1.0p-53;
 
-            // Set alloc block
-            setAllocBlock(block, total_size);
+    double interval = -log(uniform) * rate;
+    return interval < (double)(LONG_MAX / 2) ? (long)interval : LONG_MAX / 2;
+}
 
-            new_free = coalesce(new_free);
-            return pp;
-        }
+size_t sampleFilterIndex(void *pp) {
+    return (size_t)(((uintptr_t)pp >> 3) * 0x9E3779B97F4A7C15UL >> 32) % SAMPLE_FILTER_SIZE;
+}
 
-        return NULL;
+int sf_heap_profile(const char *path) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        sf_errno = errno;
+        return -1;
     }
-    
-    return NULL;
-}
 
-void *sf_memalign(size_t size, size_t align) {
-    if ((align & (align - 1)) != 0 || align < 8) {
-        sf_errno = EINVAL;
-        return NULL;
+    pthread_mutex_lock(&sample_lock);
+    for(size_t site = 0; site < sample_site_count; site++) {
+        struct sample_site *entry = &sample_sites[site];
+        if(entry->bytes == 0) {
+            continue;
+        }
+
+        // Outermost frame first
+        char **symbols = backtrace_symbols(entry->frames, entry->depth);
+        for(int i = entry->depth - 1; i >= 0; i--) {
+            sampleFrame(file, entry->frames[i], symbols != NULL ? symbols[i] : NULL);
+            fputc(i > 0 ? ';' : ' ', file);
+        }
+        fprintf(file, "%zu\n", entry->bytes);
+        free(symbols);
     }
+    pthread_mutex_unlock(&sample_lock);
 
-    if(size == 0)
-        return NULL;
+    if(fclose(file) != 0) {
+        sf_errno = errno;
+        return -1;
+    }
+    return 0;
+}
 
-    // Allocation not successfull
-    sf_errno = ENOMEM;
-    return NULL;
+void sampleFrame(FILE *file, void *frame, const char *symbol) {
+    // backtrace_symbols gives "object(function+offset) [address]"; prints the function,
+    // or the address if the symbol table has no name for it
+    const char *name = symbol != NULL ? strchr(symbol, '(') : NULL;
+    if(name != NULL && name[1] != '+' && name[1] != ')') {
+        name++;
+        size_t length = strcspn(name, "+)");
+        fwrite(name, 1, length, file);
+    }
+    else {
+        fprintf(file, "%p", frame);
+    }
 }
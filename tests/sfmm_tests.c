@@ -1,8 +1,11 @@
 #include <criterion/criterion.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
 #define TEST_TIMEOUT 15
 
 /*
@@ -247,6 +250,712 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 //Test(sfmm_student_suite, student_test_1, .timeout = TEST_TIMEOUT) {
 //}
 
+Test(sfmm_student_suite, size_class_boundaries, .timeout = TEST_TIMEOUT) {
+	// List 0 holds M, list i holds (2^(i-1) M, 2^i M], the last list everything above 256M
+	cr_assert_eq(getIndex(32), 0, "32 should map to list 0");
+	cr_assert_eq(getIndex(40), 1, "40 should map to list 1");
+	cr_assert_eq(getIndex(64), 1, "64 should map to list 1");
+	cr_assert_eq(getIndex(72), 2, "72 should map to list 2");
+	cr_assert_eq(getIndex(4024), 7, "4024 should map to list 7");
+	cr_assert_eq(getIndex(8192), 8, "256M should map to list 8");
+	cr_assert_eq(getIndex(8200), 9, "Above 256M should map to list 9");
+	cr_assert_eq(getIndex(86016), 9, "Above 256M should map to list 9");
+}
+
+Test(sfmm_student_suite, nonempty_bitmap_tracks_lists, .timeout = TEST_TIMEOUT) {
+	void *u = sf_malloc(200);
+	/* void *v = */ sf_malloc(300);
+	void *w = sf_malloc(200);
+	/* void *x = */ sf_malloc(500);
+
+	sf_free(u);
+	sf_free(w);
+	for(int i = 0; i < NUM_FREE_LISTS; i++) {
+		int empty = sf_free_list_heads[i].body.links.next == &sf_free_list_heads[i];
+		cr_assert_eq(empty, !(main_arena.nonempty_free_lists & (1u << i)), "Bitmap bit %d is stale", i);
+	}
+
+	sf_malloc(200);
+	sf_malloc(200);
+	cr_assert(!(main_arena.nonempty_free_lists & (1u << 3)), "List 3 should be empty again");
+}
+
+Test(sfmm_student_suite, quick_list_reuse_and_flush, .timeout = TEST_TIMEOUT) {
+	void *p[QUICK_LIST_MAX + 1];
+	for(int i = 0; i < QUICK_LIST_MAX + 1; i++)
+		p[i] = sf_malloc(40);
+	/* void *guard = */ sf_malloc(40);
+
+	sf_free(p[0]);
+	cr_assert_eq(sf_malloc(40), p[0], "Quick list block was not reused");
+
+	for(int i = 0; i < QUICK_LIST_MAX + 1; i++)
+		sf_free(p[i]);
+
+	// The sixth free flushed the five adjacent blocks, which coalesce into one
+	assert_quick_list_block_count(48, 1);
+	assert_quick_list_block_count(0, 1);
+	assert_free_block_count(48 * QUICK_LIST_MAX, 1);
+}
+
+Test(sfmm_student_suite, multi_page_growth, .timeout = TEST_TIMEOUT) {
+	// 20008 byte block plus prologue and epilogue needs exactly five pages
+	void *x = sf_malloc(20000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(sf_mem_start() + 5 * PAGE_SZ == sf_mem_end(), "Grew by the wrong number of pages");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(5 * PAGE_SZ - 40 - 20008, 1);
+
+	// The free tail is used before growing, so two more pages are enough here
+	void *y = sf_malloc(8000);
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert(sf_mem_start() + 7 * PAGE_SZ == sf_mem_end(), "Grew by the wrong number of pages");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(7 * PAGE_SZ - 40 - 20008 - 8008, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, wilderness_used_last, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(3000);
+	/* void *b = */ sf_malloc(800);
+	cr_assert_not_null(main_arena.wilderness, "Wilderness is not tracked");
+	cr_assert_eq(main_arena.wilderness->header & ~0x7, 240, "Wilderness has wrong size");
+
+	sf_free(a);
+
+	// The wilderness is in a lower class, but the freed block is preferred
+	void *c = sf_malloc(100);
+	cr_assert_eq(c, a, "Allocation was carved from the wilderness");
+	cr_assert_eq(main_arena.wilderness->header & ~0x7, 240, "Wilderness should be untouched");
+
+	// Growth extends the wilderness in place
+	sf_malloc(4000);
+	cr_assert_eq((char *)main_arena.wilderness + (main_arena.wilderness->header & ~0x7), (char *)sf_mem_end() - 8,
+		     "Wilderness does not end at the epilogue");
+	assert_free_block_count(0, 2);
+}
+
+static unsigned int next_rand(unsigned int *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+static void *arena_churn(void *arg) {
+	unsigned int seed = (unsigned int)(uintptr_t)arg;
+	void *live[8] = { NULL };
+	for(int i = 0; i < 2000; i++) {
+		int slot = next_rand(&seed) % 8;
+		if(live[slot] != NULL) {
+			cr_assert_eq(*(unsigned char *)live[slot], slot, "Payload was overwritten");
+			sf_free(live[slot]);
+		}
+		size_t sz = 1 + next_rand(&seed) % 200;
+		live[slot] = sf_malloc(sz);
+		cr_assert_not_null(live[slot], "Threaded malloc failed");
+		memset(live[slot], slot, sz);
+	}
+	for(int slot = 0; slot < 8; slot++)
+		sf_free(live[slot]);
+	return NULL;
+}
+
+static void *arena_alloc_one(void *arg) {
+	return sf_malloc(64);
+}
+
+Test(sfmm_student_suite, arenas_threaded_churn, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_arenas(4), 0, "sf_set_arenas failed");
+
+	pthread_t threads[4];
+	for(int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, arena_churn, (void *)(uintptr_t)(i + 1));
+	for(int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	// A block freed by another thread goes back to the arena that owns it
+	pthread_t t;
+	void *p;
+	pthread_create(&t, NULL, arena_alloc_one, NULL);
+	pthread_join(t, &p);
+	cr_assert_not_null(p, "Threaded malloc failed");
+	sf_free(p);
+
+	cr_assert_eq(sf_set_arenas(2), -1, "Arena count should not shrink");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, tcache_hits_and_flush, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_tcache(4), 0, "sf_set_tcache failed");
+
+	// First malloc misses and refills the bin with a batch of two more blocks
+	void *x = sf_malloc(40);
+	void *y = sf_malloc(40);
+	void *z = sf_malloc(40);
+	sf_tcache_counters counters;
+	sf_tcache_stats(&counters);
+	cr_assert_eq(counters.misses[2], 1, "Expected one miss (got %lu)", counters.misses[2]);
+	cr_assert_eq(counters.hits[2], 2, "Expected two hits (got %lu)", counters.hits[2]);
+	cr_assert_eq(counters.refills, 1, "Expected one refill");
+
+	// Freed blocks stay in the thread cache, not the shared quick lists
+	sf_free(x);
+	sf_free(y);
+	assert_quick_list_block_count(0, 0);
+	cr_assert_eq(sf_malloc(40), y, "Thread cache is not LIFO");
+
+	// Overflowing the bin hands its blocks back to the arena's main free lists in one batch
+	void *p[5];
+	for(int i = 0; i < 5; i++)
+		p[i] = sf_malloc(40);
+	sf_free(z);
+	for(int i = 0; i < 5; i++)
+		sf_free(p[i]);
+	sf_tcache_stats(&counters);
+	cr_assert_eq(counters.flushes, 1, "Expected one flush");
+	assert_quick_list_block_count(0, 0);
+}
+
+Test(sfmm_student_suite, quick_list_batch_flush_coalesces, .timeout = TEST_TIMEOUT) {
+	void *p[6];
+	for(int i = 0; i < 6; i++)
+		p[i] = sf_malloc(24);
+	void *guard = sf_malloc(24);
+
+	for(int i = 0; i < 5; i++)
+		sf_free(p[i]);
+	assert_quick_list_block_count(32, 5);
+
+	// The flush merges the five adjacent blocks into one free block
+	sf_free(p[5]);
+	assert_quick_list_block_count(32, 1);
+	assert_free_block_count(160, 1);
+	cr_assert_not_null(guard, "Guard allocation failed");
+}
+
+Test(sfmm_student_suite, tcache_refill_carves_adjacent_blocks, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_tcache(8), 0, "sf_set_tcache failed");
+
+	// One miss carves the whole batch from a single split, so the blocks are contiguous
+	char *x = sf_malloc(24);
+	char *y = sf_malloc(24);
+	char *z = sf_malloc(24);
+	cr_assert(y - x == 32 || x - y == 32, "Refilled blocks are not adjacent");
+	cr_assert(z - y == 32 || y - z == 32, "Refilled blocks are not adjacent");
+
+	sf_tcache_counters counters;
+	sf_tcache_stats(&counters);
+	cr_assert_eq(counters.refills, 1, "Expected one refill");
+}
+
+
+Test(sfmm_student_suite, adaptive_quick_list_capacity, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_quick_budget(65536), 0, "sf_set_quick_budget failed");
+	void *p[21];
+
+	// 48 byte blocks are reused a full list's worth, so the list grows instead of flushing
+	for(int round = 0; round < 2; round++) {
+		for(int i = 0; i < 5; i++)
+			p[i] = sf_malloc(40);
+		for(int i = 0; i < 5; i++)
+			sf_free(p[i]);
+	}
+	for(int i = 0; i < 6; i++)
+		p[i] = sf_malloc(40);
+	for(int i = 0; i < 6; i++)
+		sf_free(p[i]);
+	assert_quick_list_block_count(48, 6);
+
+	// 32 byte blocks are flushed QUICK_COLD_FILLS times without a reuse, so the list shrinks
+	for(int i = 0; i < 21; i++)
+		p[i] = sf_malloc(24);
+	for(int i = 0; i < 21; i++)
+		sf_free(p[i]);
+
+	sf_quick_counters counters;
+	sf_quick_stats(&counters);
+	cr_assert_eq(counters.capacity[2], 2 * QUICK_LIST_MAX, "Hot class did not grow (got %d)", counters.capacity[2]);
+	cr_assert_eq(counters.capacity[0], 2, "Cold class did not shrink (got %d)", counters.capacity[0]);
+	cr_assert_eq(counters.flushes[0], 4, "Expected four flushes (got %lu)", counters.flushes[0]);
+	cr_assert(counters.reserved <= counters.budget, "Quick lists exceed the budget");
+}
+
+Test(sfmm_student_suite, realloc_grows_in_place, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc(100);
+	char *y = sf_malloc(200);
+	void *z = sf_malloc(100);
+	memset(x, 'x', 100);
+	sf_free(y);
+
+	// x absorbs the freed block after it and splits off the leftover
+	cr_assert_eq(sf_realloc(x, 200), x, "realloc did not absorb the next free block");
+	assert_free_block_count(112, 1);
+
+	// z ends at the wilderness, then at the epilogue once growth needs more pages
+	cr_assert_eq(sf_realloc(z, 8000), z, "realloc did not grow into the heap");
+	cr_assert_eq(sf_realloc(z, 20000), z, "realloc did not grow into the heap");
+	cr_assert(x[99] == 'x', "Payload was not preserved");
+
+	sf_realloc_counters counters;
+	sf_realloc_stats(&counters);
+	cr_assert_eq(counters.in_place, 3, "Expected three in-place reallocs (got %lu)", counters.in_place);
+	cr_assert_eq(counters.moved, 0, "Expected no moves (got %lu)", counters.moved);
+	cr_assert_eq(counters.bytes_not_copied, 104 + 104 + 8000, "Wrong count of bytes not copied (got %lu)", counters.bytes_not_copied);
+}
+
+Test(sfmm_student_suite, memalign_reuses_free_block, .timeout = TEST_TIMEOUT) {
+	char *a = sf_malloc(5000);
+	char *guard = sf_malloc(10);
+	sf_free(a);
+
+	// The freed block spans a page boundary, so the page-aligned payload is carved
+	// from it instead of from the wilderness, and its front and back are freed
+	char *x = sf_memalign(64, 4096);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(((uintptr_t)x & 4095) == 0, "Payload is not page aligned");
+	cr_assert(x > a && x < guard, "Aligned block was not carved from the free block");
+
+	sf_block *bp = (sf_block *)(x - sizeof(sf_header));
+	cr_assert_eq(bp->header & ~0x7, 72, "Aligned block has trailing waste");
+	cr_assert_eq(bp->header & PREV_BLOCK_ALLOCATED, 0, "Prev alloc bit set after a free front");
+	assert_free_block_count(0, 3);
+
+	char *y = sf_memalign(100, 64);
+	cr_assert(((uintptr_t)y & 63) == 0, "Payload is not 64 byte aligned");
+}
+
+Test(sfmm_student_suite, memalign_small_alignments, .timeout = TEST_TIMEOUT) {
+	// Alignments of 8 and 16 are valid; only those below 8 are rejected
+	char *x = sf_memalign(40, 8);
+	cr_assert_not_null(x, "x is NULL!");
+	char *y = sf_memalign(40, 16);
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert(((uintptr_t)y & 15) == 0, "Payload is not 16 byte aligned");
+	char *z = sf_memalign(40, 16);
+	cr_assert_not_null(z, "z is NULL!");
+	cr_assert(((uintptr_t)z & 15) == 0, "Payload is not 16 byte aligned");
+
+	sf_errno = 0;
+	cr_assert_null(sf_memalign(40, 4), "Alignment of 4 was accepted");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL");
+
+	cr_assert(y >= x + 40 || x >= y + 40, "Aligned blocks overlap");
+	cr_assert(z >= y + 40 || y >= z + 40, "Aligned blocks overlap");
+	sf_free(x);
+	sf_free(y);
+	sf_free(z);
+}
+
+Test(sfmm_student_suite, cacheline_blocks_aligned_and_binned, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc_cacheline(24);
+	char *y = sf_malloc_cacheline(100);
+	cr_assert(((uintptr_t)x & 63) == 0 && ((uintptr_t)y & 63) == 0, "Payload is not cache line aligned");
+
+	sf_block *bp = (sf_block *)(y - sizeof(sf_header));
+	cr_assert_eq(bp->header & ~0x7, 136, "Payload does not span whole cache lines");
+
+	// Freed blocks wait in the cache line bins, not the quick lists
+	sf_free(x);
+	assert_quick_list_block_count(0, 0);
+	cr_assert_eq(sf_malloc_cacheline(64), x, "Cache line bin was not reused");
+	cr_assert_not_null(sf_malloc(64), "malloc failed");
+}
+
+Test(sfmm_student_suite, calloc_zeroes_reused_memory, .timeout = TEST_TIMEOUT) {
+	// Dirty memory that goes back into the wilderness, then calloc across it and past the mark
+	char *a = sf_malloc(2000);
+	memset(a, 0xff, 2000);
+	sf_free(a);
+
+	char *b = sf_calloc(1000, 6);
+	cr_assert_eq(b, a, "calloc did not reuse the freed block");
+	for(int i = 0; i < 6000; i++)
+		cr_assert_eq(b[i], 0, "Byte %d is not zero", i);
+
+	memset(b, 0xff, 6000);
+	sf_free(b);
+	char *c = sf_calloc(4, 10);
+	for(int i = 0; i < 40; i++)
+		cr_assert_eq(c[i], 0, "Byte %d is not zero", i);
+
+	cr_assert_null(sf_calloc(SIZE_MAX / 2, 4), "Overflowing calloc succeeded");
+	cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM");
+}
+
+Test(sfmm_student_suite, batch_malloc_and_free, .timeout = TEST_TIMEOUT) {
+	void *p[64];
+	cr_assert_eq(sf_malloc_batch(40, 64, p), 64, "Batch allocation came up short");
+
+	// All carved from one split, in address order
+	for(int i = 1; i < 64; i++)
+		cr_assert_eq((char *)p[i] - (char *)p[i - 1], 48, "Block %d is not adjacent to the previous one", i);
+
+	// Freed in a scrambled order, they coalesce back into the wilderness
+	void *q[64];
+	for(int i = 0; i < 64; i++)
+		q[i] = p[(i * 37) % 64];
+	sf_free_batch(q, 64);
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4056, 1);
+}
+
+Test(sfmm_student_suite, batch_free_duplicate_aborts, .signal = SIGABRT, .timeout = TEST_TIMEOUT) {
+	void *p[4];
+	sf_malloc_batch(100, 3, p);
+	p[3] = p[1];
+	sf_free_batch(p, 4);
+}
+
+Test(sfmm_student_suite, free_sized_matches_free, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(40);
+	void *y = sf_malloc(1000);
+	void *z = sf_malloc(10);
+	sf_free_sized(x, 40);
+	sf_free_sized(y, 1000);
+
+	// Same outcome as sf_free: x in its quick list, y coalesced with nothing
+	assert_quick_list_block_count(48, 1);
+	assert_free_block_count(1008, 1);
+
+	sf_free_sized(z, 10);
+	assert_quick_list_block_count(32, 1);
+}
+
+Test(sfmm_student_suite, large_class_best_fit, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(20000);
+	sf_malloc(10);
+	void *b = sf_malloc(12000);
+	sf_malloc(10);
+	void *c = sf_malloc(10000);
+	sf_malloc(10);
+	sf_free(a);
+	sf_free(b);
+	sf_free(c);
+	assert_free_list_size(NUM_FREE_LISTS - 1, 3);
+
+	// First fit would split a; best fit takes the smallest block that fits
+	cr_assert_eq(sf_malloc(9000), c, "Top class is not searched best-fit");
+	cr_assert_eq(sf_malloc(11000), b, "Top class is not searched best-fit");
+	assert_free_block_count(20008, 1);
+}
+
+Test(sfmm_student_suite, sub_bins_take_good_fit, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_set_sub_bins(3), -1, "Sub-bin count of 3 was accepted");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL");
+	cr_assert_eq(sf_set_sub_bins(4), 0, "Sub-bin count of 4 was rejected");
+
+	// Class (2048, 4096] splits into sub-bins of 512 bytes; the wilderness is in it too
+	void *a = sf_malloc(2048);
+	sf_malloc(10);
+	void *b = sf_malloc(2600);
+	sf_malloc(10);
+	void *c = sf_malloc(3500);
+	sf_malloc(10);
+	sf_free(a);
+	sf_free(b);
+	sf_free(c);
+	assert_free_list_size(7, 4);
+
+	// Plain LIFO first fit would split c, the last freed; the next sub-bin up holds b
+	cr_assert_eq(sf_malloc(2300), b, "Sub-bin search did not take the closer fit");
+	cr_assert_eq(sf_malloc(2000), a, "Sub-bin search did not take the exact sub-bin");
+	cr_assert_eq(sf_set_sub_bins(1), -1, "Sub-bin count changed after the first allocation");
+}
+
+Test(sfmm_student_suite, trim_releases_wilderness_pages, .timeout = TEST_TIMEOUT) {
+	size_t sz = 8 * PAGE_SZ;
+	char *x = sf_malloc(sz);
+	sf_malloc(10);
+	char *y = sf_malloc(sz);
+	memset(x, 'x', sz);
+	memset(y, 'y', sz);
+	sf_free(y);
+
+	// The pages of y are released; x is not in the wilderness and keeps its contents
+	size_t released = sf_trim(0);
+	cr_assert(released >= 7 * PAGE_SZ, "Released %lu bytes", released);
+	cr_assert_eq(sf_trim(0), 0, "Released pages were released again");
+	cr_assert_eq(x[sz / 2], 'x', "A block outside the wilderness was released");
+	assert_free_block_count(0, 1);
+
+	// Reused pages come back as zero pages and count as resident again
+	char *z = sf_malloc(sz);
+	cr_assert_eq(z, y, "Trimmed wilderness was not reused");
+	cr_assert_eq(z[sz / 2], 0, "Trimmed page kept its contents");
+	memset(z, 'z', sz);
+
+	// Freeing it again past the threshold trims automatically
+	sf_set_trim_threshold(4 * PAGE_SZ, PAGE_SZ);
+	sf_free(z);
+	cr_assert_eq(sf_trim(PAGE_SZ), 0, "Free past the threshold did not trim");
+	cr_assert_eq(x[sz / 2], 'x', "A block outside the wilderness was released");
+}
+
+Test(sfmm_student_suite, mmap_provider_grows_past_sfutil, .timeout = TEST_TIMEOUT) {
+	sf_page_provider provider;
+	cr_assert_eq(sf_provider_mmap(&provider, (size_t)1 << 30), 0, "Could not reserve 1 GB");
+	cr_assert_eq(sf_set_page_provider(&provider), 0, "Provider was rejected");
+
+	// Far more than the sfutil pool holds, grown in whole chunks
+	size_t sz = 256 * PAGE_SZ;
+	char *x = sf_malloc(sz);
+	cr_assert_not_null(x, "Allocation from the mmap provider failed");
+	cr_assert((size_t)(x - (char *)provider.base) < MMAP_CHUNK_PAGES * PAGE_SZ, "Block is not in the region");
+	memset(x, 'x', sz);
+	cr_assert(sf_mem_start() == sf_mem_end(), "sfutil pool was used");
+	cr_assert_eq(sf_set_page_provider(&provider), -1, "Provider changed after the first allocation");
+
+	// The region shrinks back to the pad once the block is freed
+	sf_free(x);
+	cr_assert(sf_trim(PAGE_SZ) >= 255 * PAGE_SZ, "Heap was not shrunk");
+	cr_assert_eq(sf_trim(PAGE_SZ), 0, "Heap shrunk twice");
+	char *y = sf_malloc(sz);
+	cr_assert_eq(y, x, "Regrown heap was not reused");
+	cr_assert_eq(y[sz - 1], 0, "Regrown page is not zero");
+}
+
+Test(sfmm_student_suite, buffer_provider_stays_in_buffer, .timeout = TEST_TIMEOUT) {
+	static char buffer[8 * PAGE_SZ + 5];
+	sf_page_provider provider;
+	cr_assert_eq(sf_provider_buffer(&provider, buffer + 5, 8 * PAGE_SZ), 0, "Buffer was rejected");
+	cr_assert_eq(sf_set_page_provider(&provider), 0, "Provider was rejected");
+
+	// Seven pages fit after alignment; the eighth is only partly in the buffer
+	char *x = sf_malloc(6 * PAGE_SZ);
+	cr_assert_not_null(x, "Allocation from the buffer failed");
+	cr_assert(x > buffer && x + 6 * PAGE_SZ <= buffer + sizeof(buffer), "Block is not in the buffer");
+	sf_errno = 0;
+	cr_assert_null(sf_malloc(2 * PAGE_SZ), "Allocated past the end of the buffer");
+	cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM");
+}
+
+Test(sfmm_student_suite, huge_blocks_are_mapped, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_set_mmap_threshold(PAGE_SZ), -1, "Threshold below the minimum was accepted");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL");
+	cr_assert_eq(sf_set_mmap_threshold(16 * PAGE_SZ), 0, "Threshold was rejected");
+
+	// Far more than the sfutil pool holds, and the heap never grows for it
+	char *x = sf_malloc(100000);
+	cr_assert_not_null(x, "Huge block was not mapped");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Huge block came from the heap");
+	memset(x, 'x', 100000);
+
+	sf_stats_counters stats;
+	sf_stats(&stats);
+	cr_assert_eq(stats.mmap_count, 1, "Mapped block count is %lu", stats.mmap_count);
+	cr_assert(stats.mmap_bytes >= 100000 + 8, "Mapped bytes are %lu", stats.mmap_bytes);
+
+	char *y = sf_realloc(x, 400000);
+	cr_assert_not_null(y, "Mapped block was not remapped");
+	cr_assert(y[0] == 'x' && y[99999] == 'x', "Remapped block lost its contents");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Remapped block came from the heap");
+
+	// Small blocks still come from the heap, and freeing the huge one unmaps it
+	sf_free(sf_malloc(10));
+	sf_free(y);
+	sf_stats(&stats);
+	cr_assert_eq(stats.mmap_count, 0, "Mapped block count is %lu", stats.mmap_count);
+	cr_assert_eq(stats.mmap_bytes, 0, "Mapped bytes are %lu", stats.mmap_bytes);
+	assert_free_block_count(0, 1);
+}
+
+Test(sfmm_student_suite, stats_count_class_events, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(100);
+	void *b = sf_malloc(200);
+	sf_stats_counters stats;
+	sf_stats(&stats);
+	cr_assert_eq(stats.bytes_in_use, 112 + 208, "In use bytes are %lu", stats.bytes_in_use);
+	cr_assert_eq(stats.bytes_free, PAGE_SZ - 40 - 112 - 208, "Free bytes are %lu", stats.bytes_free);
+	cr_assert_eq(stats.heap_size, PAGE_SZ, "Heap size is %lu", stats.heap_size);
+	cr_assert_eq(stats.grow_calls, 1, "Heap grew %lu times", stats.grow_calls);
+	cr_assert_eq(stats.quick_misses[(112 - 32) / 8], 1, "Quick list miss was not counted");
+	cr_assert_eq(stats.list_misses[2], 1, "Free list miss was not counted");
+	cr_assert_eq(stats.list_misses[3], 1, "Free list miss was not counted");
+	cr_assert_eq(stats.splits[7], 2, "Wilderness splits were not counted");
+
+	// a goes to its quick list and comes straight back; b coalesces into the wilderness
+	sf_free(a);
+	sf_stats(&stats);
+	cr_assert_eq(stats.bytes_cached, 112, "Cached bytes are %lu", stats.bytes_cached);
+	cr_assert_eq(sf_malloc(100), a, "Quick list block was not reused");
+	sf_free(b);
+	sf_stats(&stats);
+	cr_assert_eq(stats.quick_hits[(112 - 32) / 8], 1, "Quick list hit was not counted");
+	cr_assert_eq(stats.coalesces[7], 1, "Coalesce was not counted");
+	cr_assert_eq(stats.bytes_in_use, 112, "In use bytes are %lu", stats.bytes_in_use);
+	cr_assert_eq(stats.peak_heap, PAGE_SZ, "Peak heap is %lu", stats.peak_heap);
+}
+
+Test(sfmm_student_suite, frag_report_tracks_waste, .timeout = TEST_TIMEOUT) {
+	sf_malloc(1);
+	sf_malloc(100);
+	void *c = sf_malloc(200);
+	sf_malloc(10);
+	sf_free(c);
+
+	sf_frag_counters report;
+	sf_frag_report(&report);
+	size_t wilderness = PAGE_SZ - 40 - 32 - 112 - 208 - 32;
+	cr_assert_eq(report.requested_bytes, 311, "Requested bytes are %lu", report.requested_bytes);
+	cr_assert_eq(report.rounding_bytes, 23 + 4 + 0 + 14, "Rounding bytes are %lu", report.rounding_bytes);
+	cr_assert_eq(report.splinter_bytes, 0, "Splinter bytes are %lu", report.splinter_bytes);
+	cr_assert_eq(report.allocated_bytes, 32 + 112 + 32, "Allocated bytes are %lu", report.allocated_bytes);
+	cr_assert_eq(report.peak_allocated, 32 + 112 + 208 + 32, "Peak is %lu", report.peak_allocated);
+	cr_assert_eq(report.free_bytes, wilderness + 208, "Free bytes are %lu", report.free_bytes);
+	cr_assert_eq(report.largest_free, wilderness, "Largest free block is %lu", report.largest_free);
+	cr_assert_float_eq(report.external_fragmentation, 208.0 / (wilderness + 208), 1e-9,
+			   "External fragmentation is %f", report.external_fragmentation);
+
+	// c's block is 16 bytes too large for this request, which would leave a splinter
+	cr_assert_eq(sf_malloc(180), c, "Free block was not reused");
+	sf_frag_report(&report);
+	cr_assert_eq(report.splinter_bytes, 16, "Splinter bytes are %lu", report.splinter_bytes);
+	cr_assert_float_eq(report.internal_fragmentation, (41.0 + 4 + 16) / (32 + 112 + 208 + 32 + 208), 1e-9,
+			   "Internal fragmentation is %f", report.internal_fragmentation);
+	cr_assert_eq(report.external_fragmentation, 0, "External fragmentation is %f", report.external_fragmentation);
+}
+
+Test(sfmm_student_suite, frag_report_largest_follows_lists, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(2000);
+	sf_malloc(10);
+	void *b = sf_malloc(1000);
+	sf_malloc(10);
+	sf_free(a);
+	sf_free(b);
+
+	// a's block is larger than the wilderness until most of it is taken again
+	sf_frag_counters report;
+	sf_frag_report(&report);
+	cr_assert_eq(report.largest_free, 2008, "Largest free block is %lu", report.largest_free);
+	cr_assert_eq(sf_malloc(1900), a, "Free block was not reused");
+	sf_frag_report(&report);
+	cr_assert_eq(report.largest_free, 1008, "Largest free block is %lu", report.largest_free);
+	sf_malloc(1000);
+	sf_frag_report(&report);
+	cr_assert_eq(report.largest_free, PAGE_SZ - 40 - 2008 - 32 - 1008 - 32, "Largest free block is %lu", report.largest_free);
+}
+
+Test(sfmm_student_suite, trace_records_calls, .timeout = TEST_TIMEOUT) {
+	const char *path = "/tmp/sfmm_trace_test";
+	void *before = sf_malloc(5);
+	cr_assert_eq(sf_trace_start(path), 0, "Recording did not start");
+	cr_assert_eq(sf_trace_start(path), -1, "Recording started twice");
+
+	void *a = sf_malloc(100);
+	void *b = sf_memalign(200, 64);
+	a = sf_realloc(a, 300);
+	sf_free(before);
+	sf_free(b);
+	void *c = sf_malloc(10);
+	sf_realloc(c, 0);
+	sf_free(a);
+	sf_trace_stop();
+
+	// Nothing is recorded for the block from before, nor for the malloc and free the
+	// realloc made, and c gets the ID b gave back.  Sizes are LEB128 varints.
+	unsigned char expected[] = { 'S', 'F', 'T', 'R', SF_TRACE_VERSION,
+				     'a', 0, 100, 'm', 1, 0xC8, 0x01, 64, 'r', 0, 0xAC, 0x02,
+				     'f', 1, 'a', 1, 10, 'f', 1, 'f', 0 };
+	unsigned char trace[64];
+	FILE *file = fopen(path, "rb");
+	cr_assert_not_null(file, "Trace was not written");
+	size_t length = fread(trace, 1, sizeof(trace), file);
+	fclose(file);
+	remove(path);
+	cr_assert_eq(length, sizeof(expected), "Trace is %lu bytes", length);
+	cr_assert(memcmp(trace, expected, length) == 0, "Trace records are wrong");
+}
+
+#ifdef LATENCY_HISTOGRAMS
+Test(sfmm_student_suite, latency_histograms_split_paths, .timeout = TEST_TIMEOUT) {
+	sf_latency_reset();
+	void *a = sf_malloc(100);		// grows the heap
+	sf_free(a);				// onto its quick list
+	a = sf_malloc(100);			// off the quick list
+	cr_assert_eq(sf_realloc(a, 104), a, "Realloc moved a block it fits");
+	void *b = sf_malloc(1000);		// split from the wilderness
+	sf_free(b);				// coalesced back into it
+	sf_memalign(100, 64);
+
+	int expected[LATENCY_ENTRIES][LATENCY_PATHS] = {
+		[LATENCY_MALLOC] = { 1, 1, 1 },
+		[LATENCY_FREE] = { 1, 1, 0 },
+		[LATENCY_REALLOC] = { 1, 0, 0 },
+		[LATENCY_MEMALIGN] = { 0, 1, 0 },
+	};
+	for (int entry = 0; entry < LATENCY_ENTRIES; entry++) {
+		for (int path = 0; path < LATENCY_PATHS; path++) {
+			sf_latency_summary summary;
+			sf_latency(entry, path, &summary);
+			cr_assert_eq(summary.count, expected[entry][path], "Entry %d path %d has %lu samples",
+				     entry, path, summary.count);
+			cr_assert(summary.p50 <= summary.p99 && summary.p99 <= summary.p999 && summary.p999 <= summary.max,
+				  "Percentiles of entry %d path %d are out of order", entry, path);
+		}
+	}
+}
+#endif
+
+Test(sfmm_student_suite, heap_profile_sums_live_bytes, .timeout = TEST_TIMEOUT) {
+	// At a rate of one byte every request is sampled and stands for its own size
+	const char *path = "/tmp/sfmm_profile_test";
+	sf_set_heap_sampling(1);
+	void *a = sf_malloc(100);
+	void *b = sf_calloc(4, 50);
+	void *c = sf_memalign(300, 64);
+	sf_free(a);
+	c = sf_realloc(c, 500);
+	sf_set_heap_sampling(0);
+
+	size_t total = 0, lines = 0, bytes;
+	char line[4096];
+	cr_assert_eq(sf_heap_profile(path), 0, "Profile was not written");
+	FILE *file = fopen(path, "r");
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char *count = strrchr(line, ' ');
+		cr_assert(count != NULL && count > line, "Line has no stack: %s", line);
+		cr_assert_eq(sscanf(count, "%zu", &bytes), 1, "Line has no byte count: %s", line);
+		total += bytes;
+		lines++;
+	}
+	fclose(file);
+	cr_assert_eq(total, 200 + 500, "Profile holds %lu bytes", total);
+	cr_assert(lines >= 2, "Sites of b and c were merged");
+
+	// Freed blocks leave the profile, even though sampling is now off
+	sf_free(b);
+	sf_free(c);
+	cr_assert_eq(sf_heap_profile(path), 0, "Profile was not written");
+	file = fopen(path, "r");
+	cr_assert_eq(fgetc(file), EOF, "Profile of an empty heap is not empty");
+	fclose(file);
+	remove(path);
+}
+
+Test(sfmm_student_suite, heap_profile_keeps_failed_realloc, .timeout = TEST_TIMEOUT) {
+	// A realloc that fails leaves its block under the site it was sampled at
+	const char *path = "/tmp/sfmm_profile_test";
+	char before[4096], after[4096];
+	sf_set_heap_sampling(1);
+	void *a = sf_malloc(100);
+	cr_assert_eq(sf_heap_profile(path), 0, "Profile was not written");
+	FILE *file = fopen(path, "r");
+	size_t length = fread(before, 1, sizeof(before), file);
+	fclose(file);
+
+	cr_assert_null(sf_realloc(a, (size_t)1 << 62), "Realloc did not fail");
+	cr_assert_eq(sf_heap_profile(path), 0, "Profile was not written");
+	file = fopen(path, "r");
+	cr_assert_eq(fread(after, 1, sizeof(after), file), length, "Profile changed size");
+	fclose(file);
+	cr_assert(length > 0 && memcmp(before, after, length) == 0, "Profile changed");
+
+	sf_free(a);
+	sf_set_heap_sampling(0);
+	remove(path);
+}
 
 
 ////////////////////////////////////////////////// GRADING HELPERS //////////////////////////////////////////////////////////
@@ -986,13 +1695,15 @@ Test(sf_memsuite_grading, realloc_larger, .timeout=TEST_TIMEOUT)
     _assert_nonnull_payload_pointer(x);
     _assert_block_info((sf_block *)((char *)x - 8), 1, 208);
 
+    // x is followed by the wilderness, so it grows in place
     void * y = sf_realloc(x, nsz);
     _assert_nonnull_payload_pointer(y);
     _assert_block_info((sf_block *)((char *)y - 8), 1, 1032);
 
-    _assert_free_block_count(208, 1);
+    cr_assert_eq(x, y, "realloc to larger size did not grow in place");
+    _assert_free_block_count(0, 1);
     _assert_quick_list_block_count(0, 0);
-    _assert_free_block_count(2816, 1);
+    _assert_free_block_count(3024, 1);
 
     _assert_errno_eq(0);
 }